@@ -1,12 +1,26 @@
 #include <llvm-c/Analysis.h>
+#include <llvm-c/BitReader.h>
 #include <llvm-c/BitWriter.h>
+#include <llvm-c/Comdat.h>
 #include <llvm-c/Core.h>
+#include <llvm-c/DebugInfo.h>
+#include <llvm-c/Error.h>
 #include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/IRReader.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Linker.h>
+#include <llvm-c/Object.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/OrcEE.h>
 #include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
 #include <llvm-c/Types.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "moonbit.h"
 
@@ -1280,6 +1294,8 @@ LLVMBool __llvm_comdat_is_null(void *comdat) { return comdat == NULL ? 1 : 0; }
 
 void *__llvm_new_null() { return (void *)NULL; }
 
+uint64_t __llvm_ref_address(void *ref) { return (uint64_t)(uintptr_t)ref; }
+
 // ty1: LLVMTypeRef, ty2: LLVMTypeRef
 LLVMBool __llvm_same_type_ref(void *ty1, void *ty2) {
   return ty1 == ty2 ? 1 : 0;
@@ -1573,23 +1589,28 @@ void __llvm_set_cmp_xchg_failure_ordering(void *cmp_xchg_inst, int o) {
   LLVMSetCmpXchgFailureOrdering((LLVMValueRef)cmp_xchg_inst, ordering);
 }
 
-// TODO: Incorrect implementation
-// LLVMBool __llvm_create_memory_buffer_with_contents_of_file(void *path,
-//                                                            void
-//                                                            **out_mem_buf,
-//                                                            void
-//                                                            **out_message) {
-//   return LLVMCreateMemoryBufferWithContentsOfFile(
-//       (const char *)path, (LLVMMemoryBufferRef *)out_mem_buf,
-//       (char **)out_message);
-// }
-//
 // LLVMBool __llvm_create_memory_buffer_with_stdin(void **out_mem_buf,
 //                                                 void **out_message) {
 //   return LLVMCreateMemoryBufferWithSTDIN((LLVMMemoryBufferRef *)out_mem_buf,
 //                                          (char **)out_message);
 // }
 
+// ================================================
+// Target
+// ================================================
+
+LLVMBool __llvm_initialize_native_target() {
+  return LLVMInitializeNativeTarget();
+}
+
+LLVMBool __llvm_initialize_native_asm_parser() {
+  return LLVMInitializeNativeAsmParser();
+}
+
+LLVMBool __llvm_initialize_native_asm_printer() {
+  return LLVMInitializeNativeAsmPrinter();
+}
+
 // ================================================
 // ExecutionEngine
 // ================================================
@@ -1602,3 +1623,3320 @@ LLVMExecutionEngineRef llvm_new_execution_engine() {
 // LLJIT
 // ================================================
 
+// Turns a function definition into a declaration, in the same way as
+// Function::deleteBody does.
+static void llvm_strip_function_body(LLVMValueRef fn) {
+  LLVMBasicBlockRef bb;
+  for (bb = LLVMGetFirstBasicBlock(fn); bb; bb = LLVMGetNextBasicBlock(bb)) {
+    LLVMValueRef inst;
+    for (inst = LLVMGetFirstInstruction(bb); inst;
+         inst = LLVMGetNextInstruction(inst)) {
+      LLVMTypeRef ty = LLVMTypeOf(inst);
+      switch (LLVMGetTypeKind(ty)) {
+      case LLVMVoidTypeKind:
+        break;
+      case LLVMTokenTypeKind:
+        LLVMReplaceAllUsesWith(inst, LLVMConstNull(ty));
+        break;
+      default:
+        LLVMReplaceAllUsesWith(inst, LLVMGetUndef(ty));
+        break;
+      }
+    }
+  }
+  while ((bb = LLVMGetFirstBasicBlock(fn)) != NULL) {
+    LLVMValueRef inst;
+    while ((inst = LLVMGetFirstInstruction(bb)) != NULL) {
+      LLVMInstructionEraseFromParent(inst);
+    }
+    LLVMDeleteBasicBlock(bb);
+  }
+  if (LLVMHasPersonalityFn(fn)) {
+    LLVMSetPersonalityFn(fn, NULL);
+  }
+  LLVMSetLinkage(fn, LLVMExternalLinkage);
+}
+
+// Strips every function body from `m` except the one named `keep`. When
+// `keep` is non-null the global variables are turned into declarations as
+// well, so that the module defines nothing but `keep`.
+static void llvm_strip_module_except(LLVMModuleRef m, const char *keep) {
+  LLVMValueRef fn = LLVMGetFirstFunction(m);
+  while (fn) {
+    LLVMValueRef next = LLVMGetNextFunction(fn);
+    size_t len;
+    const char *name = LLVMGetValueName2(fn, &len);
+    if (!LLVMIsDeclaration(fn) && (keep == NULL || strcmp(name, keep) != 0)) {
+      llvm_strip_function_body(fn);
+    }
+    fn = next;
+  }
+  if (keep == NULL) {
+    return;
+  }
+  LLVMValueRef gv = LLVMGetFirstGlobal(m);
+  while (gv) {
+    LLVMValueRef next = LLVMGetNextGlobal(gv);
+    if (LLVMGetLinkage(gv) == LLVMAppendingLinkage) {
+      LLVMDeleteGlobal(gv);
+    } else if (!LLVMIsDeclaration(gv)) {
+      LLVMSetInitializer(gv, NULL);
+      LLVMSetLinkage(gv, LLVMExternalLinkage);
+    }
+    gv = next;
+  }
+}
+
+// A module added through LLVMOrcLLJITAddLazyModule. Its function bodies are
+// cloned out one at a time, the first time each of them is called.
+typedef struct {
+  LLVMOrcLLJITRef jit;
+  LLVMOrcThreadSafeContextRef ts_ctx;
+  LLVMOrcThreadSafeModuleRef source;
+  pthread_mutex_t lock;
+  int refs;
+} llvm_lazy_source;
+
+typedef struct {
+  llvm_lazy_source *source;
+  char *body_name;
+  LLVMModuleRef result;
+} llvm_lazy_body;
+
+static void llvm_lazy_source_release(llvm_lazy_source *source) {
+  pthread_mutex_lock(&source->lock);
+  int refs = --source->refs;
+  pthread_mutex_unlock(&source->lock);
+  if (refs == 0) {
+    LLVMOrcDisposeThreadSafeModule(source->source);
+    pthread_mutex_destroy(&source->lock);
+    free(source);
+  }
+}
+
+static void llvm_lazy_body_dispose(llvm_lazy_body *body) {
+  llvm_lazy_source_release(body->source);
+  free(body->body_name);
+  free(body);
+}
+
+static LLVMErrorRef llvm_lazy_body_extract(void *ctx, LLVMModuleRef m) {
+  llvm_lazy_body *body = (llvm_lazy_body *)ctx;
+  body->result = LLVMCloneModule(m);
+  llvm_strip_module_except(body->result, body->body_name);
+  return LLVMErrorSuccess;
+}
+
+static void
+llvm_lazy_body_materialize(void *ctx,
+                           LLVMOrcMaterializationResponsibilityRef mr) {
+  llvm_lazy_body *body = (llvm_lazy_body *)ctx;
+  llvm_lazy_source *source = body->source;
+  LLVMErrorRef err = LLVMOrcThreadSafeModuleWithModuleDo(
+      source->source, llvm_lazy_body_extract, body);
+  if (err) {
+    LLVMConsumeError(err);
+    LLVMOrcMaterializationResponsibilityFailMaterialization(mr);
+    LLVMOrcDisposeMaterializationResponsibility(mr);
+  } else {
+    LLVMOrcThreadSafeModuleRef tsm =
+        LLVMOrcCreateNewThreadSafeModule(body->result, source->ts_ctx);
+    LLVMOrcIRTransformLayerEmit(LLVMOrcLLJITGetIRTransformLayer(source->jit),
+                                mr, tsm);
+  }
+  // The materialization unit does not call Destroy once it has materialized.
+  llvm_lazy_body_dispose(body);
+}
+
+static void llvm_lazy_body_discard(void *ctx, LLVMOrcJITDylibRef jd,
+                                   LLVMOrcSymbolStringPoolEntryRef symbol) {}
+
+static void llvm_lazy_body_destroy(void *ctx) {
+  llvm_lazy_body_dispose((llvm_lazy_body *)ctx);
+}
+
+// Adds the variable definitions and function declarations of `m` to `jd`
+// eagerly, and keeps `m` aside as the source of the lazily compiled bodies.
+// Takes ownership of `m`.
+LLVMErrorRef __llvm_orc_lljit_add_lazy_source(void *j, void *jd, void *ts_ctx,
+                                              void *m, void **out_source) {
+  LLVMModuleRef globals = LLVMCloneModule((LLVMModuleRef)m);
+  llvm_strip_module_except(globals, NULL);
+  LLVMErrorRef err = LLVMOrcLLJITAddLLVMIRModule(
+      (LLVMOrcLLJITRef)j, (LLVMOrcJITDylibRef)jd,
+      LLVMOrcCreateNewThreadSafeModule(
+          globals, (LLVMOrcThreadSafeContextRef)ts_ctx));
+  if (err) {
+    LLVMDisposeModule((LLVMModuleRef)m);
+    return err;
+  }
+  llvm_lazy_source *source =
+      (llvm_lazy_source *)malloc(sizeof(llvm_lazy_source));
+  source->jit = (LLVMOrcLLJITRef)j;
+  source->ts_ctx = (LLVMOrcThreadSafeContextRef)ts_ctx;
+  source->source = LLVMOrcCreateNewThreadSafeModule(
+      (LLVMModuleRef)m, (LLVMOrcThreadSafeContextRef)ts_ctx);
+  pthread_mutex_init(&source->lock, NULL);
+  source->refs = 1;
+  *out_source = source;
+  return LLVMErrorSuccess;
+}
+
+void __llvm_orc_lljit_release_lazy_source(void *source) {
+  llvm_lazy_source_release((llvm_lazy_source *)source);
+}
+
+// Defines `body_name` in `jd` as a symbol that is compiled on first lookup,
+// and `stub_name` as a lazy reexport of it, so that calling `stub_name`
+// triggers the compilation.
+LLVMErrorRef __llvm_orc_lljit_add_lazy_function(void *jd, void *source,
+                                                void *body_name,
+                                                void *stub_name, void *lctm,
+                                                void *ism) {
+  llvm_lazy_source *src = (llvm_lazy_source *)source;
+  LLVMJITSymbolFlags flags = {LLVMJITSymbolGenericFlagsExported |
+                                  LLVMJITSymbolGenericFlagsCallable,
+                              0};
+
+  llvm_lazy_body *body = (llvm_lazy_body *)malloc(sizeof(llvm_lazy_body));
+  body->source = src;
+  body->body_name = strdup((const char *)body_name);
+  body->result = NULL;
+  pthread_mutex_lock(&src->lock);
+  src->refs++;
+  pthread_mutex_unlock(&src->lock);
+
+  LLVMOrcCSymbolFlagsMapPair sym = {
+      LLVMOrcLLJITMangleAndIntern(src->jit, (const char *)body_name), flags};
+  LLVMOrcMaterializationUnitRef mu = LLVMOrcCreateCustomMaterializationUnit(
+      (const char *)body_name, body, &sym, 1, NULL, llvm_lazy_body_materialize,
+      llvm_lazy_body_discard, llvm_lazy_body_destroy);
+  LLVMErrorRef err = LLVMOrcJITDylibDefine((LLVMOrcJITDylibRef)jd, mu);
+  if (err) {
+    LLVMOrcDisposeMaterializationUnit(mu);
+    return err;
+  }
+
+  LLVMOrcCSymbolAliasMapPair alias = {
+      LLVMOrcLLJITMangleAndIntern(src->jit, (const char *)stub_name),
+      {LLVMOrcLLJITMangleAndIntern(src->jit, (const char *)body_name), flags}};
+  mu = LLVMOrcLazyReexports((LLVMOrcLazyCallThroughManagerRef)lctm,
+                            (LLVMOrcIndirectStubsManagerRef)ism,
+                            (LLVMOrcJITDylibRef)jd, &alias, 1);
+  err = LLVMOrcJITDylibDefine((LLVMOrcJITDylibRef)jd, mu);
+  if (err) {
+    LLVMOrcDisposeMaterializationUnit(mu);
+  }
+  return err;
+}
+
+// names: LLVMOrcSymbolStringPoolEntryRef[num_pairs], each retained for this
+// function.
+LLVMErrorRef __llvm_orc_jit_dylib_define_absolute_symbols(void *jd,
+                                                         void **names,
+                                                         uint64_t *addrs,
+                                                         int32_t num_pairs) {
+  LLVMOrcCSymbolMapPairs syms =
+      (LLVMOrcCSymbolMapPairs)malloc(sizeof(*syms) * num_pairs);
+  for (int32_t i = 0; i < num_pairs; i++) {
+    syms[i].Name = (LLVMOrcSymbolStringPoolEntryRef)names[i];
+    syms[i].Sym.Address = addrs[i];
+    syms[i].Sym.Flags.GenericFlags =
+        LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable;
+    syms[i].Sym.Flags.TargetFlags = 0;
+  }
+  LLVMOrcMaterializationUnitRef mu = LLVMOrcAbsoluteSymbols(syms, num_pairs);
+  free(syms);
+  LLVMErrorRef err = LLVMOrcJITDylibDefine((LLVMOrcJITDylibRef)jd, mu);
+  if (err) {
+    LLVMOrcDisposeMaterializationUnit(mu);
+  }
+  return err;
+}
+
+LLVMErrorRef
+__llvm_orc_create_dynamic_library_search_generator_for_process(
+    void **result, char global_prefix) {
+  return LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(
+      (LLVMOrcDefinitionGeneratorRef *)result, global_prefix, NULL, NULL);
+}
+
+typedef struct {
+  LLVMOrcSymbolStringPoolEntryRef name;
+  int32_t index;
+} llvm_lookup_slot;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int done;
+  LLVMErrorRef err;
+  llvm_lookup_slot *slots;
+  int32_t num_slots;
+  uint64_t *addrs;
+} llvm_lookup_state;
+
+static int llvm_lookup_slot_compare(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((const llvm_lookup_slot *)a)->name;
+  uintptr_t y = (uintptr_t)((const llvm_lookup_slot *)b)->name;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Symbol string pool entries are uniqued, so the results are matched back to
+// the requested symbols by pointer, with a binary search over the sorted
+// requests.
+static void llvm_lookup_handle_result(LLVMErrorRef err,
+                                      LLVMOrcCSymbolMapPairs result,
+                                      size_t num_pairs, void *ctx) {
+  llvm_lookup_state *state = (llvm_lookup_state *)ctx;
+  if (!err) {
+    for (size_t i = 0; i < num_pairs; i++) {
+      llvm_lookup_slot key = {result[i].Name, 0};
+      llvm_lookup_slot *slot = (llvm_lookup_slot *)bsearch(
+          &key, state->slots, state->num_slots, sizeof(llvm_lookup_slot),
+          llvm_lookup_slot_compare);
+      if (slot == NULL) {
+        continue;
+      }
+      // A symbol requested several times occupies adjacent slots.
+      while (slot > state->slots && (slot - 1)->name == key.name) {
+        slot--;
+      }
+      for (; slot < state->slots + state->num_slots && slot->name == key.name;
+           slot++) {
+        state->addrs[slot->index] = result[i].Sym.Address;
+      }
+    }
+  }
+  pthread_mutex_lock(&state->lock);
+  state->err = err;
+  state->done = 1;
+  pthread_cond_signal(&state->cond);
+  pthread_mutex_unlock(&state->lock);
+}
+
+// Looks up all of `names` in `jd` at once, and blocks until their addresses
+// are written to `addrs`. The names stay owned by the caller.
+LLVMErrorRef __llvm_orc_execution_session_lookup_symbols(void *es, void *jd,
+                                                        void **names,
+                                                        uint64_t *addrs,
+                                                        int32_t num_symbols) {
+  llvm_lookup_state state;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.cond, NULL);
+  state.done = 0;
+  state.err = LLVMErrorSuccess;
+  state.slots =
+      (llvm_lookup_slot *)malloc(sizeof(llvm_lookup_slot) * num_symbols);
+  state.num_slots = num_symbols;
+  state.addrs = addrs;
+
+  LLVMOrcCLookupSet lookup_set = (LLVMOrcCLookupSet)malloc(
+      sizeof(LLVMOrcCLookupSetElement) * num_symbols);
+  size_t lookup_set_size = 0;
+  for (int32_t i = 0; i < num_symbols; i++) {
+    state.slots[i].name = (LLVMOrcSymbolStringPoolEntryRef)names[i];
+    state.slots[i].index = i;
+    addrs[i] = 0;
+  }
+  qsort(state.slots, num_symbols, sizeof(llvm_lookup_slot),
+        llvm_lookup_slot_compare);
+  for (int32_t i = 0; i < num_symbols; i++) {
+    if (i > 0 && state.slots[i].name == state.slots[i - 1].name) {
+      continue;
+    }
+    // The lookup takes ownership of the names in the lookup set.
+    LLVMOrcRetainSymbolStringPoolEntry(state.slots[i].name);
+    lookup_set[lookup_set_size].Name = state.slots[i].name;
+    lookup_set[lookup_set_size].LookupFlags =
+        LLVMOrcSymbolLookupFlagsRequiredSymbol;
+    lookup_set_size++;
+  }
+
+  LLVMOrcCJITDylibSearchOrderElement search_order = {
+      (LLVMOrcJITDylibRef)jd, LLVMOrcJITDylibLookupFlagsMatchAllSymbols};
+  LLVMOrcExecutionSessionLookup((LLVMOrcExecutionSessionRef)es,
+                                LLVMOrcLookupKindStatic, &search_order, 1,
+                                lookup_set, lookup_set_size,
+                                llvm_lookup_handle_result, &state);
+
+  pthread_mutex_lock(&state.lock);
+  while (!state.done) {
+    pthread_cond_wait(&state.cond, &state.lock);
+  }
+  pthread_mutex_unlock(&state.lock);
+
+  free(lookup_set);
+  free(state.slots);
+  pthread_cond_destroy(&state.cond);
+  pthread_mutex_destroy(&state.lock);
+  return state.err;
+}
+
+// JIT event listeners, as flags packed into the context pointer of the
+// object linking layer creator.
+#define LLVM_JIT_LISTENER_GDB 1
+#define LLVM_JIT_LISTENER_PERF 2
+
+static LLVMOrcObjectLayerRef
+llvm_create_listening_object_layer(void *ctx, LLVMOrcExecutionSessionRef es,
+                                   const char *triple) {
+  (void)triple;
+  intptr_t listeners = (intptr_t)ctx;
+  LLVMOrcObjectLayerRef layer =
+      LLVMOrcCreateRTDyldObjectLinkingLayerWithSectionMemoryManager(es);
+  if (listeners & LLVM_JIT_LISTENER_GDB) {
+    LLVMOrcRTDyldObjectLinkingLayerRegisterJITEventListener(
+        layer, LLVMCreateGDBRegistrationListener());
+  }
+  if (listeners & LLVM_JIT_LISTENER_PERF) {
+    LLVMOrcRTDyldObjectLinkingLayerRegisterJITEventListener(
+        layer, LLVMCreatePerfJITEventListener());
+  }
+  return layer;
+}
+
+// Makes the JIT built by `builder` link objects with RuntimeDyld and report
+// them to the GDB JIT interface and to perf, as requested. Returns 0, and
+// leaves the builder untouched, if LLVM was built without perf support.
+int32_t __llvm_orc_lljit_builder_set_jit_event_listeners(void *builder,
+                                                         int32_t gdb,
+                                                         int32_t perf) {
+  // Both listeners are process-wide singletons, never to be disposed.
+  if (perf && !LLVMCreatePerfJITEventListener()) {
+    return 0;
+  }
+  intptr_t listeners =
+      (gdb ? LLVM_JIT_LISTENER_GDB : 0) | (perf ? LLVM_JIT_LISTENER_PERF : 0);
+  if (listeners) {
+    LLVMOrcLLJITBuilderSetObjectLinkingLayerCreator(
+        (LLVMOrcLLJITBuilderRef)builder, llvm_create_listening_object_layer,
+        (void *)listeners);
+  }
+  return 1;
+}
+
+// ================================================
+// Tiered execution
+// ================================================
+
+// Every argument and the return value of a promoted function travel through
+// 64-bit slots, so that a single trampoline can call any of them.
+static int llvm_tier_slot_type(LLVMTypeRef ty) {
+  switch (LLVMGetTypeKind(ty)) {
+  case LLVMIntegerTypeKind:
+    return LLVMGetIntTypeWidth(ty) <= 64;
+  case LLVMFloatTypeKind:
+  case LLVMDoubleTypeKind:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static LLVMValueRef llvm_tier_from_slot(LLVMBuilderRef b, LLVMValueRef slot,
+                                        LLVMTypeRef ty) {
+  LLVMContextRef ctx = LLVMGetTypeContext(ty);
+  switch (LLVMGetTypeKind(ty)) {
+  case LLVMFloatTypeKind:
+    return LLVMBuildBitCast(
+        b, LLVMBuildTrunc(b, slot, LLVMInt32TypeInContext(ctx), ""), ty, "");
+  case LLVMDoubleTypeKind:
+    return LLVMBuildBitCast(b, slot, ty, "");
+  default:
+    return LLVMGetIntTypeWidth(ty) == 64 ? slot
+                                         : LLVMBuildTrunc(b, slot, ty, "");
+  }
+}
+
+static LLVMValueRef llvm_tier_to_slot(LLVMBuilderRef b, LLVMValueRef val) {
+  LLVMTypeRef ty = LLVMTypeOf(val);
+  LLVMContextRef ctx = LLVMGetTypeContext(ty);
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+  switch (LLVMGetTypeKind(ty)) {
+  case LLVMFloatTypeKind:
+    return LLVMBuildZExt(
+        b, LLVMBuildBitCast(b, val, LLVMInt32TypeInContext(ctx), ""), i64, "");
+  case LLVMDoubleTypeKind:
+    return LLVMBuildBitCast(b, val, i64, "");
+  default:
+    return LLVMGetIntTypeWidth(ty) == 64 ? val : LLVMBuildZExt(b, val, i64, "");
+  }
+}
+
+// Builds `void name(i64 *args, i64 *ret)` calling `fn` with the unpacked
+// arguments. Returns NULL if the signature of `fn` does not fit in slots.
+static LLVMValueRef llvm_tier_build_entry(LLVMModuleRef m, LLVMValueRef fn,
+                                          const char *name) {
+  LLVMTypeRef fty = LLVMGlobalGetValueType(fn);
+  LLVMTypeRef ret_ty = LLVMGetReturnType(fty);
+  unsigned num_params = LLVMCountParamTypes(fty);
+  if (LLVMIsFunctionVarArg(fty) ||
+      (LLVMGetTypeKind(ret_ty) != LLVMVoidTypeKind &&
+       !llvm_tier_slot_type(ret_ty))) {
+    return NULL;
+  }
+  LLVMTypeRef *param_tys =
+      (LLVMTypeRef *)malloc(sizeof(LLVMTypeRef) * (num_params + 1));
+  LLVMGetParamTypes(fty, param_tys);
+  for (unsigned i = 0; i < num_params; i++) {
+    if (!llvm_tier_slot_type(param_tys[i])) {
+      free(param_tys);
+      return NULL;
+    }
+  }
+
+  LLVMContextRef ctx = LLVMGetModuleContext(m);
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+  LLVMTypeRef ptr = LLVMPointerType(i64, 0);
+  LLVMTypeRef entry_params[2] = {ptr, ptr};
+  LLVMTypeRef entry_ty =
+      LLVMFunctionType(LLVMVoidTypeInContext(ctx), entry_params, 2, 0);
+  LLVMValueRef entry = LLVMAddFunction(m, name, entry_ty);
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+  LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(ctx, entry, ""));
+
+  LLVMValueRef *args =
+      (LLVMValueRef *)malloc(sizeof(LLVMValueRef) * (num_params + 1));
+  for (unsigned i = 0; i < num_params; i++) {
+    LLVMValueRef idx = LLVMConstInt(i64, i, 0);
+    LLVMValueRef addr = LLVMBuildGEP2(b, i64, LLVMGetParam(entry, 0), &idx, 1, "");
+    LLVMValueRef slot = LLVMBuildLoad2(b, i64, addr, "");
+    args[i] = llvm_tier_from_slot(b, slot, param_tys[i]);
+  }
+  LLVMValueRef call = LLVMBuildCall2(b, fty, fn, args, num_params, "");
+  LLVMSetInstructionCallConv(call, LLVMGetFunctionCallConv(fn));
+  if (LLVMGetTypeKind(ret_ty) != LLVMVoidTypeKind) {
+    LLVMBuildStore(b, llvm_tier_to_slot(b, call), LLVMGetParam(entry, 1));
+  }
+  LLVMBuildRetVoid(b);
+
+  LLVMDisposeBuilder(b);
+  free(args);
+  free(param_tys);
+  return entry;
+}
+
+// Whether promoted code must use the interpreter's storage of `gv` rather
+// than a copy of its own: true for every variable the program can write.
+int32_t __llvm_tier_shares_global(void *gv) {
+  LLVMValueRef v = (LLVMValueRef)gv;
+  return LLVMIsAGlobalVariable(v) && !LLVMIsDeclaration(v) &&
+         !LLVMIsGlobalConstant(v) &&
+         LLVMGetLinkage(v) != LLVMAppendingLinkage;
+}
+
+// Turns the shared variables of `m`, the i-th global being named
+// `__tier.global.<i>`, into declarations, which the executor defines as
+// absolute symbols at the addresses the interpreter keeps them at.
+static void llvm_tier_share_globals(LLVMModuleRef m) {
+  char name[32];
+  unsigned i = 0;
+  LLVMValueRef gv;
+  for (gv = LLVMGetFirstGlobal(m); gv; gv = LLVMGetNextGlobal(gv), i++) {
+    if (!__llvm_tier_shares_global(gv)) {
+      continue;
+    }
+    int len = snprintf(name, sizeof(name), "__tier.global.%u", i);
+    LLVMSetValueName2(gv, name, (size_t)len);
+    LLVMSetInitializer(gv, NULL);
+    LLVMSetComdat(gv, NULL);
+    LLVMSetThreadLocal(gv, 0);
+    LLVMSetLinkage(gv, LLVMExternalLinkage);
+    LLVMSetVisibility(gv, LLVMDefaultVisibility);
+  }
+}
+
+// Gives every definition but `keep` internal linkage, so that the private
+// copies made by several promotions never clash inside the JIT, and the
+// optimizer is free to inline and drop them.
+static void llvm_tier_internalize(LLVMModuleRef m, LLVMValueRef keep) {
+  LLVMValueRef fn;
+  for (fn = LLVMGetFirstFunction(m); fn; fn = LLVMGetNextFunction(fn)) {
+    if (fn != keep && !LLVMIsDeclaration(fn)) {
+      LLVMSetLinkage(fn, LLVMInternalLinkage);
+      LLVMSetVisibility(fn, LLVMDefaultVisibility);
+    }
+  }
+  LLVMValueRef gv;
+  for (gv = LLVMGetFirstGlobal(m); gv; gv = LLVMGetNextGlobal(gv)) {
+    if (!LLVMIsDeclaration(gv) &&
+        LLVMGetLinkage(gv) != LLVMAppendingLinkage) {
+      LLVMSetLinkage(gv, LLVMInternalLinkage);
+      LLVMSetVisibility(gv, LLVMDefaultVisibility);
+    }
+  }
+}
+
+static LLVMTargetMachineRef
+llvm_create_host_target_machine(int opt_level, LLVMRelocMode reloc,
+                                LLVMCodeModel code_model) {
+  char *triple = LLVMGetDefaultTargetTriple();
+  char *cpu = LLVMGetHostCPUName();
+  char *features = LLVMGetHostCPUFeatures();
+  LLVMTargetRef target;
+  char *message = NULL;
+  LLVMTargetMachineRef tm = NULL;
+  if (!LLVMGetTargetFromTriple(triple, &target, &message)) {
+    LLVMCodeGenOptLevel level =
+        opt_level <= 0   ? LLVMCodeGenLevelNone
+        : opt_level == 1 ? LLVMCodeGenLevelLess
+        : opt_level == 2 ? LLVMCodeGenLevelDefault
+                         : LLVMCodeGenLevelAggressive;
+    tm = LLVMCreateTargetMachine(target, triple, cpu, features, level, reloc,
+                                 code_model);
+  }
+  if (message) {
+    LLVMDisposeMessage(message);
+  }
+  LLVMDisposeMessage(features);
+  LLVMDisposeMessage(cpu);
+  LLVMDisposeMessage(triple);
+  return tm;
+}
+
+void *__llvm_create_host_target_machine(int32_t opt_level) {
+  return llvm_create_host_target_machine(opt_level, LLVMRelocDefault,
+                                         LLVMCodeModelDefault);
+}
+
+// The target machine the optimizer of `m` should ask for costs: the host's if
+// `m` targets the host, else a generic CPU of its triple. NULL if `m` has no
+// triple, or if it is not the host's and its target was not initialized.
+void *__llvm_create_module_target_machine(void *m) {
+  const char *triple = LLVMGetTarget((LLVMModuleRef)m);
+  if (!*triple) {
+    return NULL;
+  }
+  char *normal = LLVMNormalizeTargetTriple(triple);
+  char *host = LLVMGetDefaultTargetTriple();
+  char *host_normal = LLVMNormalizeTargetTriple(host);
+  LLVMTargetMachineRef tm = NULL;
+  if (!strcmp(normal, host_normal)) {
+    if (!LLVMInitializeNativeTarget()) {
+      tm = llvm_create_host_target_machine(2, LLVMRelocDefault,
+                                           LLVMCodeModelDefault);
+    }
+  } else {
+    LLVMTargetRef target;
+    char *message = NULL;
+    if (!LLVMGetTargetFromTriple(normal, &target, &message)) {
+      tm = LLVMCreateTargetMachine(target, normal, "generic", "",
+                                   LLVMCodeGenLevelDefault, LLVMRelocDefault,
+                                   LLVMCodeModelDefault);
+    }
+    if (message) {
+      LLVMDisposeMessage(message);
+    }
+  }
+  LLVMDisposeMessage(host_normal);
+  LLVMDisposeMessage(host);
+  LLVMDisposeMessage(normal);
+  return tm;
+}
+
+enum {
+  LLVM_TIER_JOB_RUNNING = 0,
+  LLVM_TIER_JOB_DONE = 1,
+  LLVM_TIER_JOB_FAILED = 2,
+};
+
+typedef struct {
+  pthread_t thread;
+  LLVMOrcLLJITRef jit;
+  LLVMMemoryBufferRef bitcode;
+  char *fn_name;
+  int opt_level;
+  uint64_t addr;
+  int status;
+} llvm_tier_job;
+
+static int llvm_tier_job_compile(llvm_tier_job *job) {
+  LLVMOrcThreadSafeContextRef ts_ctx = LLVMOrcCreateNewThreadSafeContext();
+  LLVMContextRef ctx = LLVMOrcThreadSafeContextGetContext(ts_ctx);
+  LLVMModuleRef m = NULL;
+  if (LLVMParseBitcodeInContext2(ctx, job->bitcode, &m)) {
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+    return 0;
+  }
+
+  size_t len = strlen(job->fn_name);
+  char *entry_name = (char *)malloc(len + sizeof(".tier.entry"));
+  memcpy(entry_name, job->fn_name, len);
+  memcpy(entry_name + len, ".tier.entry", sizeof(".tier.entry"));
+  LLVMValueRef fn = LLVMGetNamedFunction(m, job->fn_name);
+  LLVMValueRef entry =
+      fn && !LLVMIsDeclaration(fn) ? llvm_tier_build_entry(m, fn, entry_name)
+                                   : NULL;
+  LLVMTargetMachineRef tm =
+      entry ? llvm_create_host_target_machine(job->opt_level, LLVMRelocDefault,
+                                              LLVMCodeModelJITDefault)
+            : NULL;
+  if (!tm) {
+    free(entry_name);
+    LLVMDisposeModule(m);
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+    return 0;
+  }
+  llvm_tier_share_globals(m);
+  llvm_tier_internalize(m, entry);
+
+  char *triple = LLVMGetTargetMachineTriple(tm);
+  LLVMSetTarget(m, triple);
+  LLVMDisposeMessage(triple);
+  LLVMTargetDataRef dl = LLVMCreateTargetDataLayout(tm);
+  LLVMSetModuleDataLayout(m, dl);
+  LLVMDisposeTargetData(dl);
+
+  LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+  LLVMErrorRef err = LLVMRunPasses(
+      m, job->opt_level >= 3 ? "default<O3>" : "default<O2>", tm, options);
+  LLVMDisposePassBuilderOptions(options);
+  LLVMDisposeTargetMachine(tm);
+  if (err) {
+    LLVMConsumeError(err);
+    free(entry_name);
+    LLVMDisposeModule(m);
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+    return 0;
+  }
+
+  LLVMOrcThreadSafeModuleRef tsm = LLVMOrcCreateNewThreadSafeModule(m, ts_ctx);
+  LLVMOrcDisposeThreadSafeContext(ts_ctx);
+  err = LLVMOrcLLJITAddLLVMIRModule(
+      job->jit, LLVMOrcLLJITGetMainJITDylib(job->jit), tsm);
+  LLVMOrcExecutorAddress addr = 0;
+  if (!err) {
+    err = LLVMOrcLLJITLookup(job->jit, &addr, entry_name);
+  }
+  free(entry_name);
+  if (err) {
+    LLVMConsumeError(err);
+    return 0;
+  }
+  job->addr = addr;
+  return 1;
+}
+
+static void *llvm_tier_job_run(void *arg) {
+  llvm_tier_job *job = (llvm_tier_job *)arg;
+  int ok = llvm_tier_job_compile(job);
+  __atomic_store_n(&job->status, ok ? LLVM_TIER_JOB_DONE : LLVM_TIER_JOB_FAILED,
+                   __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Compiles `fn_name` out of `bitcode` on a background thread, optimized at
+// `opt_level`, and adds it to `jit`. `bitcode` is only read, and must stay
+// alive until the job is joined.
+void *__llvm_tier_job_start(void *jit, void *bitcode, void *fn_name,
+                            int32_t opt_level) {
+  llvm_tier_job *job = (llvm_tier_job *)malloc(sizeof(llvm_tier_job));
+  job->jit = (LLVMOrcLLJITRef)jit;
+  job->bitcode = (LLVMMemoryBufferRef)bitcode;
+  job->fn_name = strdup((const char *)fn_name);
+  job->opt_level = opt_level;
+  job->addr = 0;
+  job->status = LLVM_TIER_JOB_RUNNING;
+  if (pthread_create(&job->thread, NULL, llvm_tier_job_run, job) != 0) {
+    // No thread available, compile on the caller's thread instead.
+    llvm_tier_job_run(job);
+    job->thread = pthread_self();
+  }
+  return job;
+}
+
+int32_t __llvm_tier_job_status(void *job) {
+  return __atomic_load_n(&((llvm_tier_job *)job)->status, __ATOMIC_ACQUIRE);
+}
+
+// Only meaningful once the status is LLVM_TIER_JOB_DONE.
+uint64_t __llvm_tier_job_address(void *job) {
+  return ((llvm_tier_job *)job)->addr;
+}
+
+void __llvm_tier_job_join(void *job) {
+  llvm_tier_job *j = (llvm_tier_job *)job;
+  if (!pthread_equal(j->thread, pthread_self())) {
+    pthread_join(j->thread, NULL);
+  }
+  free(j->fn_name);
+  free(j);
+}
+
+void __llvm_tier_call(uint64_t addr, uint64_t *args, uint64_t *ret) {
+  ((void (*)(uint64_t *, uint64_t *))(uintptr_t)addr)(args, ret);
+}
+
+// ================================================
+// Batch execution
+// ================================================
+
+// A batch kernel maps columns of 64-bit values, one per parameter, to a
+// column of results: doubles for floating point values, int64s for
+// integers, which are sign extended.
+static int llvm_batch_column_type(LLVMTypeRef ty) {
+  switch (LLVMGetTypeKind(ty)) {
+  case LLVMIntegerTypeKind:
+    return LLVMGetIntTypeWidth(ty) <= 64;
+  case LLVMFloatTypeKind:
+  case LLVMDoubleTypeKind:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Builds `void name(i64 n, ptr columns, ptr out)` calling `fn` on row `i` of
+// each of the `n`-row columns in the array `columns`, and storing the result
+// to `out[i]`. Returns 0 if the signature of `fn` does not fit in columns.
+int32_t __llvm_build_batch_kernel(LLVMModuleRef m, LLVMValueRef fn,
+                                  const char *name) {
+  LLVMTypeRef fty = LLVMGlobalGetValueType(fn);
+  LLVMTypeRef ret_ty = LLVMGetReturnType(fty);
+  unsigned num_params = LLVMCountParamTypes(fty);
+  int has_ret = LLVMGetTypeKind(ret_ty) != LLVMVoidTypeKind;
+  if (LLVMIsFunctionVarArg(fty) ||
+      (has_ret && !llvm_batch_column_type(ret_ty))) {
+    return 0;
+  }
+  LLVMTypeRef *param_tys =
+      (LLVMTypeRef *)malloc(sizeof(LLVMTypeRef) * (num_params + 1));
+  LLVMGetParamTypes(fty, param_tys);
+  for (unsigned i = 0; i < num_params; i++) {
+    if (!llvm_batch_column_type(param_tys[i])) {
+      free(param_tys);
+      return 0;
+    }
+  }
+
+  LLVMContextRef ctx = LLVMGetModuleContext(m);
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+  LLVMTypeRef f64 = LLVMDoubleTypeInContext(ctx);
+  LLVMTypeRef ptr = LLVMPointerType(i64, 0);
+  LLVMTypeRef ptr_ptr = LLVMPointerType(ptr, 0);
+  LLVMTypeRef kernel_params[3] = {i64, ptr_ptr, ptr};
+  LLVMValueRef kernel = LLVMAddFunction(
+      m, name, LLVMFunctionType(LLVMVoidTypeInContext(ctx), kernel_params, 3, 0));
+  LLVMValueRef n = LLVMGetParam(kernel, 0);
+  LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, kernel, "entry");
+  LLVMBasicBlockRef loop = LLVMAppendBasicBlockInContext(ctx, kernel, "loop");
+  LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(ctx, kernel, "exit");
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+
+  // The column pointers are loaded once, ahead of the loop.
+  LLVMPositionBuilderAtEnd(b, entry);
+  LLVMValueRef *columns =
+      (LLVMValueRef *)malloc(sizeof(LLVMValueRef) * (num_params + 1));
+  for (unsigned p = 0; p < num_params; p++) {
+    LLVMValueRef idx = LLVMConstInt(i64, p, 0);
+    LLVMValueRef addr =
+        LLVMBuildGEP2(b, ptr, LLVMGetParam(kernel, 1), &idx, 1, "");
+    columns[p] = LLVMBuildLoad2(b, ptr, addr, "column");
+  }
+  LLVMValueRef zero = LLVMConstInt(i64, 0, 0);
+  LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntSGT, n, zero, ""), loop, exit);
+
+  LLVMPositionBuilderAtEnd(b, loop);
+  LLVMValueRef i = LLVMBuildPhi(b, i64, "i");
+  LLVMValueRef *args =
+      (LLVMValueRef *)malloc(sizeof(LLVMValueRef) * (num_params + 1));
+  for (unsigned p = 0; p < num_params; p++) {
+    LLVMTypeRef ty = param_tys[p];
+    int is_int = LLVMGetTypeKind(ty) == LLVMIntegerTypeKind;
+    LLVMTypeRef elem_ty = is_int ? i64 : f64;
+    LLVMValueRef addr = LLVMBuildGEP2(
+        b, elem_ty,
+        LLVMBuildBitCast(b, columns[p], LLVMPointerType(elem_ty, 0), ""), &i,
+        1, "");
+    LLVMValueRef v = LLVMBuildLoad2(b, elem_ty, addr, "");
+    if (is_int && LLVMGetIntTypeWidth(ty) < 64) {
+      v = LLVMBuildTrunc(b, v, ty, "");
+    } else if (LLVMGetTypeKind(ty) == LLVMFloatTypeKind) {
+      v = LLVMBuildFPTrunc(b, v, ty, "");
+    }
+    args[p] = v;
+  }
+  LLVMValueRef call = LLVMBuildCall2(b, fty, fn, args, num_params, "");
+  LLVMSetInstructionCallConv(call, LLVMGetFunctionCallConv(fn));
+  if (has_ret) {
+    int is_int = LLVMGetTypeKind(ret_ty) == LLVMIntegerTypeKind;
+    LLVMTypeRef elem_ty = is_int ? i64 : f64;
+    LLVMValueRef v = call;
+    if (is_int && LLVMGetIntTypeWidth(ret_ty) < 64) {
+      v = LLVMBuildSExt(b, v, i64, "");
+    } else if (LLVMGetTypeKind(ret_ty) == LLVMFloatTypeKind) {
+      v = LLVMBuildFPExt(b, v, f64, "");
+    }
+    LLVMValueRef out = LLVMBuildBitCast(b, LLVMGetParam(kernel, 2),
+                                        LLVMPointerType(elem_ty, 0), "");
+    LLVMBuildStore(b, v, LLVMBuildGEP2(b, elem_ty, out, &i, 1, ""));
+  }
+  LLVMValueRef next = LLVMBuildAdd(b, i, LLVMConstInt(i64, 1, 0), "next");
+  LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntSLT, next, n, ""), loop, exit);
+  LLVMValueRef incoming[2] = {zero, next};
+  LLVMBasicBlockRef incoming_bbs[2] = {entry, loop};
+  LLVMAddIncoming(i, incoming, incoming_bbs, 2);
+
+  LLVMPositionBuilderAtEnd(b, exit);
+  LLVMBuildRetVoid(b);
+
+  LLVMDisposeBuilder(b);
+  free(args);
+  free(columns);
+  free(param_tys);
+  return 1;
+}
+
+typedef struct {
+  int32_t count;
+  void **columns;
+} llvm_batch_columns;
+
+void *__llvm_batch_columns_new(int32_t count) {
+  llvm_batch_columns *cols =
+      (llvm_batch_columns *)malloc(sizeof(llvm_batch_columns));
+  cols->count = count;
+  cols->columns = (void **)calloc(count + 1, sizeof(void *));
+  return cols;
+}
+
+// Takes a reference to `column`, a FixedArray of 64-bit values, until the
+// columns are run.
+void __llvm_batch_columns_set(void *cols, int32_t i, void *column) {
+  ((llvm_batch_columns *)cols)->columns[i] = column;
+}
+
+// Runs the kernel at `addr` over the first `n` rows of the columns, storing
+// the results to `out`, then releases the columns and frees them.
+void __llvm_batch_run(uint64_t addr, int64_t n, void *cols, void *out) {
+  llvm_batch_columns *c = (llvm_batch_columns *)cols;
+  ((void (*)(int64_t, void **, void *))(uintptr_t)addr)(n, c->columns, out);
+  for (int32_t i = 0; i < c->count; i++) {
+    if (c->columns[i]) {
+      moonbit_decref(c->columns[i]);
+    }
+  }
+  free(c->columns);
+  free(c);
+}
+
+// Profiling
+
+void __llvm_read_counters(uint64_t addr, uint64_t *counters, int32_t n) {
+  memcpy(counters, (const void *)(uintptr_t)addr, sizeof(uint64_t) * n);
+}
+
+int32_t __llvm_write_file(const char *path, const char *data, uint64_t len) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    return 0;
+  }
+  size_t written = fwrite(data, 1, len, f);
+  return fclose(f) == 0 && written == len;
+}
+
+// Creates an empty file named uniquely, ending with `suffix`, in $TMPDIR or
+// /tmp. Returns its path, to be freed, or NULL.
+char *__llvm_create_temp_file(const char *suffix) {
+  const char *dir = getenv("TMPDIR");
+  if (!dir || !*dir) {
+    dir = "/tmp";
+  }
+  size_t len = strlen(dir) + sizeof("/llvm-mbt-XXXXXX") + strlen(suffix);
+  char *path = (char *)malloc(len);
+  snprintf(path, len, "%s/llvm-mbt-XXXXXX%s", dir, suffix);
+  int fd = mkstemps(path, (int)strlen(suffix));
+  if (fd < 0) {
+    free(path);
+    return NULL;
+  }
+  close(fd);
+  return path;
+}
+
+int32_t __llvm_remove_file(const char *path) { return remove(path) == 0; }
+
+// Fragments
+
+static uint64_t llvm_fnv_bytes(uint64_t h, const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint64_t llvm_fnv_u64(uint64_t h, uint64_t v) {
+  return llvm_fnv_bytes(h, (const char *)&v, sizeof(v));
+}
+
+// Attribute group (#N) and metadata (!N) numbers depend on the rest of the
+// module, so they are left out and what they refer to is hashed instead.
+static uint64_t llvm_hash_printed(uint64_t h, const char *text) {
+  for (const char *p = text; *p; p++) {
+    h = llvm_fnv_bytes(h, p, 1);
+    if ((*p == '#' || *p == '!') && p[1] >= '0' && p[1] <= '9') {
+      while (p[1] >= '0' && p[1] <= '9') {
+        p++;
+      }
+    }
+  }
+  return h;
+}
+
+static uint64_t llvm_hash_value(uint64_t h, LLVMValueRef v) {
+  char *text = LLVMPrintValueToString(v);
+  h = llvm_hash_printed(h, text);
+  LLVMDisposeMessage(text);
+  return h;
+}
+
+static uint64_t llvm_hash_type(uint64_t h, LLVMTypeRef t) {
+  char *text = LLVMPrintTypeToString(t);
+  h = llvm_hash_printed(h, text);
+  LLVMDisposeMessage(text);
+  return h;
+}
+
+static uint64_t llvm_hash_attrs(uint64_t h, LLVMAttributeRef *attrs,
+                                unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    unsigned len;
+    if (LLVMIsStringAttribute(attrs[i])) {
+      const char *kind = LLVMGetStringAttributeKind(attrs[i], &len);
+      h = llvm_fnv_bytes(llvm_fnv_u64(h, len), kind, len);
+      const char *value = LLVMGetStringAttributeValue(attrs[i], &len);
+      h = llvm_fnv_bytes(llvm_fnv_u64(h, len), value, len);
+    } else {
+      h = llvm_fnv_u64(h, LLVMGetEnumAttributeKind(attrs[i]));
+      if (LLVMIsTypeAttribute(attrs[i])) {
+        h = llvm_hash_type(h, LLVMGetTypeAttributeValue(attrs[i]));
+      } else {
+        h = llvm_fnv_u64(h, LLVMGetEnumAttributeValue(attrs[i]));
+      }
+    }
+  }
+  return h;
+}
+
+static uint64_t llvm_hash_fn_attrs(uint64_t h, LLVMValueRef fn) {
+  unsigned num_params = LLVMCountParams(fn);
+  for (unsigned i = 0; i <= num_params + 1; i++) {
+    LLVMAttributeIndex idx = i == num_params + 1 ? LLVMAttributeFunctionIndex : i;
+    unsigned n = LLVMGetAttributeCountAtIndex(fn, idx);
+    LLVMAttributeRef *attrs =
+        (LLVMAttributeRef *)malloc(sizeof(LLVMAttributeRef) * (n + 1));
+    LLVMGetAttributesAtIndex(fn, idx, attrs);
+    h = llvm_hash_attrs(llvm_fnv_u64(h, n), attrs, n);
+    free(attrs);
+  }
+  return h;
+}
+
+static uint64_t llvm_hash_call_attrs(uint64_t h, LLVMValueRef call) {
+  unsigned n = LLVMGetCallSiteAttributeCount(call, LLVMAttributeFunctionIndex);
+  LLVMAttributeRef *attrs =
+      (LLVMAttributeRef *)malloc(sizeof(LLVMAttributeRef) * (n + 1));
+  LLVMGetCallSiteAttributes(call, LLVMAttributeFunctionIndex, attrs);
+  h = llvm_hash_attrs(llvm_fnv_u64(h, n), attrs, n);
+  free(attrs);
+  return h;
+}
+
+// Hashes the metadata `md` without wrapping it in a value, which the context
+// would keep for good. The C API only reads the operands of a node or the
+// bytes of a string through such a wrapper, so debug locations are hashed
+// through their getters, and other metadata by identity: the context keeps
+// uniqued metadata for its whole life, so there the address of a node
+// stands for its content. The caller tells contexts apart.
+static uint64_t llvm_hash_md(uint64_t h, LLVMMetadataRef md, int depth) {
+  if (!md) {
+    return llvm_fnv_u64(h, 0);
+  }
+  LLVMMetadataKind kind = LLVMGetMetadataKind(md);
+  h = llvm_fnv_u64(h, kind + 1);
+  if (kind != LLVMDILocationMetadataKind) {
+    return llvm_fnv_u64(h, (uint64_t)(uintptr_t)md);
+  }
+  h = llvm_fnv_u64(h, LLVMDILocationGetLine(md));
+  h = llvm_fnv_u64(h, LLVMDILocationGetColumn(md));
+  h = llvm_hash_md(h, LLVMDILocationGetScope(md), depth + 1);
+  // Bounded, as inlined-at chains can be long.
+  if (depth >= 8) {
+    return h;
+  }
+  return llvm_hash_md(h, LLVMDILocationGetInlinedAt(md), depth + 1);
+}
+
+static uint64_t llvm_hash_md_entries(uint64_t h,
+                                     LLVMValueMetadataEntry *entries,
+                                     size_t n) {
+  for (unsigned i = 0; i < n; i++) {
+    h = llvm_fnv_u64(h, LLVMValueMetadataEntriesGetKind(entries, i));
+    h = llvm_hash_md(h, LLVMValueMetadataEntriesGetMetadata(entries, i), 0);
+  }
+  if (entries) {
+    LLVMDisposeValueMetadataEntries(entries);
+  }
+  return h;
+}
+
+// What a function depends on of the globals it refers to: their type,
+// linkage and, for functions, attributes.
+static uint64_t llvm_hash_operand(uint64_t h, LLVMValueRef op, int depth) {
+  if (LLVMIsAGlobalValue(op)) {
+    size_t len;
+    const char *name = LLVMGetValueName2(op, &len);
+    h = llvm_fnv_bytes(llvm_fnv_u64(h, len), name, len);
+    h = llvm_hash_type(h, LLVMGlobalGetValueType(op));
+    h = llvm_fnv_u64(h, LLVMGetLinkage(op));
+    h = llvm_fnv_u64(h, LLVMGetVisibility(op));
+    if (LLVMIsAFunction(op)) {
+      h = llvm_hash_fn_attrs(h, op);
+    }
+  } else if (LLVMIsAConstantExpr(op) && depth < 4) {
+    int n = LLVMGetNumOperands(op);
+    for (int i = 0; i < n; i++) {
+      h = llvm_hash_operand(h, LLVMGetOperand(op, i), depth + 1);
+    }
+  }
+  return h;
+}
+
+// Content hash of a function definition, covering its IR, debug locations,
+// metadata and attributes, and the signatures of the globals it refers to.
+// Unlike the printed IR, it does not change with the rest of the module.
+uint64_t __llvm_function_content_hash(LLVMValueRef fn) {
+  uint64_t h = llvm_hash_value(14695981039346656037ULL, fn);
+  h = llvm_hash_fn_attrs(h, fn);
+  size_t n;
+  LLVMValueMetadataEntry *entries = LLVMGlobalCopyAllMetadata(fn, &n);
+  h = llvm_hash_md_entries(h, entries, n);
+  for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+         inst = LLVMGetNextInstruction(inst)) {
+      LLVMMetadataRef loc = LLVMInstructionGetDebugLoc(inst);
+      if (loc) {
+        h = llvm_fnv_u64(h, LLVMDILocationGetLine(loc));
+        h = llvm_fnv_u64(h, LLVMDILocationGetColumn(loc));
+      }
+      entries = LLVMInstructionGetAllMetadataOtherThanDebugLoc(inst, &n);
+      h = llvm_hash_md_entries(h, entries, n);
+      if (LLVMIsACallInst(inst) || LLVMIsAInvokeInst(inst)) {
+        h = llvm_hash_call_attrs(h, inst);
+      }
+      int num_ops = LLVMGetNumOperands(inst);
+      for (int i = 0; i < num_ops; i++) {
+        h = llvm_hash_operand(h, LLVMGetOperand(inst, i), 0);
+      }
+    }
+  }
+  return h;
+}
+
+// Content hash of the global variables of `m` and its inline assembly.
+uint64_t __llvm_globals_content_hash(LLVMModuleRef m) {
+  size_t len;
+  const char *asm_text = LLVMGetModuleInlineAsm(m, &len);
+  uint64_t h = llvm_fnv_bytes(14695981039346656037ULL, asm_text, len);
+  for (LLVMValueRef gv = LLVMGetFirstGlobal(m); gv;
+       gv = LLVMGetNextGlobal(gv)) {
+    h = llvm_hash_value(h, gv);
+    size_t n;
+    LLVMValueMetadataEntry *entries = LLVMGlobalCopyAllMetadata(gv, &n);
+    h = llvm_hash_md_entries(h, entries, n);
+  }
+  return h;
+}
+
+static void llvm_externalize(LLVMValueRef v, const char *suffix,
+                             int *unnamed) {
+  if (LLVMIsDeclaration(v)) {
+    return;
+  }
+  LLVMLinkage linkage = LLVMGetLinkage(v);
+  int local = linkage == LLVMInternalLinkage || linkage == LLVMPrivateLinkage;
+  size_t len;
+  const char *name = LLVMGetValueName2(v, &len);
+  if (!local && len) {
+    return;
+  }
+  size_t suffix_len = strlen(suffix);
+  char *renamed = (char *)malloc(len + suffix_len + 32);
+  if (len) {
+    memcpy(renamed, name, len);
+  } else {
+    len = sprintf(renamed, "__unnamed.%d", (*unnamed)++);
+  }
+  memcpy(renamed + len, suffix, suffix_len);
+  LLVMSetValueName2(v, renamed, len + suffix_len);
+  free(renamed);
+  if (local) {
+    LLVMSetLinkage(v, LLVMExternalLinkage);
+    LLVMSetVisibility(v, LLVMHiddenVisibility);
+  }
+}
+
+// Gives the local definitions of `m` external linkage and hidden visibility,
+// so that they can be referred to from other fragments. They are renamed
+// with `suffix`, so that they cannot clash with the symbols of other modules,
+// and so are the unnamed definitions, which get a name.
+void __llvm_externalize_locals(LLVMModuleRef m, const char *suffix) {
+  int unnamed = 0;
+  for (LLVMValueRef fn = LLVMGetFirstFunction(m); fn;
+       fn = LLVMGetNextFunction(fn)) {
+    llvm_externalize(fn, suffix, &unnamed);
+  }
+  for (LLVMValueRef gv = LLVMGetFirstGlobal(m); gv;
+       gv = LLVMGetNextGlobal(gv)) {
+    llvm_externalize(gv, suffix, &unnamed);
+  }
+}
+
+// There is no `Function::deleteBody` in the C API: drop the uses between the
+// instructions first, so that they and the blocks can be erased in any order.
+static void llvm_delete_body(LLVMValueRef fn) {
+  LLVMBasicBlockRef bb;
+  for (bb = LLVMGetFirstBasicBlock(fn); bb; bb = LLVMGetNextBasicBlock(bb)) {
+    for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+         inst = LLVMGetNextInstruction(inst)) {
+      if (LLVMGetTypeKind(LLVMTypeOf(inst)) != LLVMVoidTypeKind) {
+        LLVMReplaceAllUsesWith(inst, LLVMGetPoison(LLVMTypeOf(inst)));
+      }
+    }
+  }
+  for (bb = LLVMGetFirstBasicBlock(fn); bb; bb = LLVMGetNextBasicBlock(bb)) {
+    LLVMValueRef inst = LLVMGetFirstInstruction(bb);
+    while (inst) {
+      LLVMValueRef next = LLVMGetNextInstruction(inst);
+      LLVMInstructionEraseFromParent(inst);
+      inst = next;
+    }
+  }
+  while ((bb = LLVMGetFirstBasicBlock(fn))) {
+    LLVMDeleteBasicBlock(bb);
+  }
+  if (LLVMHasPersonalityFn(fn)) {
+    LLVMSetPersonalityFn(fn, NULL);
+  }
+  LLVMGlobalClearMetadata(fn);
+  LLVMSetLinkage(fn, LLVMExternalLinkage);
+  LLVMSetComdat(fn, NULL);
+}
+
+// Turns the function and global variable definitions of `m` not flagged in
+// `keep_fns` and `keep_gvs` (one flag each, in module order) into
+// declarations, then drops the declarations left unused. Appending globals
+// such as `llvm.global_ctors` are dropped rather than declared, as is the
+// inline assembly unless `keep_asm`.
+void __llvm_keep_definitions(LLVMModuleRef m, uint8_t *keep_fns,
+                             uint8_t *keep_gvs, int32_t keep_asm) {
+  int i = 0;
+  for (LLVMValueRef fn = LLVMGetFirstFunction(m); fn;
+       fn = LLVMGetNextFunction(fn), i++) {
+    if (!keep_fns[i] && !LLVMIsDeclaration(fn)) {
+      llvm_delete_body(fn);
+    }
+  }
+  i = 0;
+  LLVMValueRef gv = LLVMGetFirstGlobal(m);
+  while (gv) {
+    LLVMValueRef next = LLVMGetNextGlobal(gv);
+    if (!keep_gvs[i] && !LLVMIsDeclaration(gv)) {
+      if (LLVMGetLinkage(gv) == LLVMAppendingLinkage) {
+        LLVMDeleteGlobal(gv);
+      } else {
+        LLVMSetInitializer(gv, NULL);
+        LLVMSetLinkage(gv, LLVMExternalLinkage);
+        LLVMSetComdat(gv, NULL);
+      }
+    }
+    gv = next;
+    i++;
+  }
+  if (!keep_asm) {
+    LLVMSetModuleInlineAsm2(m, "", 0);
+  }
+  LLVMValueRef fn = LLVMGetFirstFunction(m);
+  while (fn) {
+    LLVMValueRef next = LLVMGetNextFunction(fn);
+    if (LLVMIsDeclaration(fn) && !LLVMGetFirstUse(fn)) {
+      LLVMDeleteFunction(fn);
+    }
+    fn = next;
+  }
+  gv = LLVMGetFirstGlobal(m);
+  while (gv) {
+    LLVMValueRef next = LLVMGetNextGlobal(gv);
+    if (LLVMIsDeclaration(gv) && !LLVMGetFirstUse(gv)) {
+      LLVMDeleteGlobal(gv);
+    }
+    gv = next;
+  }
+}
+
+// Partitions
+
+static size_t llvm_ptr_slot(const void *p, size_t capacity) {
+  return (size_t)(((uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL) >> 32) &
+         (capacity - 1);
+}
+
+// A map between pointers, by open addressing.
+typedef struct {
+  const void **keys;
+  void **values;
+  size_t capacity;
+  size_t count;
+} llvm_ptr_map;
+
+static void llvm_ptr_map_put(llvm_ptr_map *map, const void *key, void *value) {
+  if (2 * (map->count + 1) > map->capacity) {
+    size_t capacity = map->capacity ? 2 * map->capacity : 64;
+    const void **keys = (const void **)calloc(capacity, sizeof(void *));
+    void **values = (void **)calloc(capacity, sizeof(void *));
+    for (size_t i = 0; i < map->capacity; i++) {
+      if (map->keys[i]) {
+        size_t j = llvm_ptr_slot(map->keys[i], capacity);
+        while (keys[j]) {
+          j = (j + 1) & (capacity - 1);
+        }
+        keys[j] = map->keys[i];
+        values[j] = map->values[i];
+      }
+    }
+    free(map->keys);
+    free(map->values);
+    map->keys = keys;
+    map->values = values;
+    map->capacity = capacity;
+  }
+  size_t j = llvm_ptr_slot(key, map->capacity);
+  while (map->keys[j] && map->keys[j] != key) {
+    j = (j + 1) & (map->capacity - 1);
+  }
+  if (!map->keys[j]) {
+    map->keys[j] = key;
+    map->count++;
+  }
+  map->values[j] = value;
+}
+
+// Returns the value of `key`, or NULL.
+static void *llvm_ptr_map_get(const llvm_ptr_map *map, const void *key) {
+  if (!map->capacity) {
+    return NULL;
+  }
+  size_t j = llvm_ptr_slot(key, map->capacity);
+  while (map->keys[j]) {
+    if (map->keys[j] == key) {
+      return map->values[j];
+    }
+    j = (j + 1) & (map->capacity - 1);
+  }
+  return NULL;
+}
+
+static int llvm_uf_find(int32_t *parent, int32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+static void llvm_uf_union(int32_t *parent, int32_t a, int32_t b) {
+  a = llvm_uf_find(parent, a);
+  b = llvm_uf_find(parent, b);
+  if (a != b) {
+    parent[a < b ? b : a] = a < b ? a : b;
+  }
+}
+
+// The global values of a module, by position, with the position of each.
+typedef struct {
+  LLVMValueRef *values;
+  int32_t count;
+  llvm_ptr_map positions;
+} llvm_global_index;
+
+// Fills `index->values[0, count)` first, then call this.
+static void llvm_global_index_build(llvm_global_index *index) {
+  for (int32_t i = 0; i < index->count; i++) {
+    llvm_ptr_map_put(&index->positions, index->values[i],
+                     (void *)(intptr_t)(i + 1));
+  }
+}
+
+static int32_t llvm_global_index_of(llvm_global_index *index, LLVMValueRef v) {
+  return (int32_t)(intptr_t)llvm_ptr_map_get(&index->positions, v) - 1;
+}
+
+static void llvm_global_index_free(llvm_global_index *index) {
+  free(index->values);
+  free(index->positions.keys);
+  free(index->positions.values);
+}
+
+// Unites `def` with the definitions using it, looking through constants.
+static void llvm_unite_users(llvm_global_index *index, int32_t *parent,
+                             int32_t def, LLVMValueRef v, int depth) {
+  for (LLVMUseRef use = LLVMGetFirstUse(v); use; use = LLVMGetNextUse(use)) {
+    LLVMValueRef user = LLVMGetUser(use);
+    int32_t other = -1;
+    if (LLVMIsAInstruction(user)) {
+      LLVMBasicBlockRef bb = LLVMGetInstructionParent(user);
+      other = llvm_global_index_of(index, LLVMGetBasicBlockParent(bb));
+    } else if (LLVMIsAGlobalValue(user)) {
+      other = llvm_global_index_of(index, user);
+    } else if (LLVMIsAConstant(user) && depth < 8) {
+      llvm_unite_users(index, parent, def, user, depth + 1);
+    }
+    if (other >= 0) {
+      llvm_uf_union(parent, def, other);
+    }
+  }
+}
+
+typedef struct {
+  int32_t root;
+  int64_t weight;
+} llvm_component;
+
+static int llvm_component_cmp(const void *a, const void *b) {
+  const llvm_component *x = (const llvm_component *)a;
+  const llvm_component *y = (const llvm_component *)b;
+  if (x->weight != y->weight) {
+    return x->weight < y->weight ? 1 : -1;
+  }
+  return x->root - y->root;
+}
+
+// Assigns every function and global variable definition of `m` to one of
+// `n` partitions, writing it to `fn_part` and `gv_part` (one entry each, in
+// module order, -1 for declarations). A local definition is kept with the
+// definitions using it, and so are the members of a comdat. Appending
+// globals go to partition 0. Partitions are balanced by instruction count.
+void __llvm_partition_module(LLVMModuleRef m, int32_t n, int32_t *fn_part,
+                             int32_t *gv_part) {
+  int32_t num_fns = 0, num_gvs = 0;
+  LLVMValueRef v;
+  for (v = LLVMGetFirstFunction(m); v; v = LLVMGetNextFunction(v)) {
+    num_fns++;
+  }
+  for (v = LLVMGetFirstGlobal(m); v; v = LLVMGetNextGlobal(v)) {
+    num_gvs++;
+  }
+  int32_t total = num_fns + num_gvs;
+  llvm_global_index index = {
+      (LLVMValueRef *)malloc(sizeof(LLVMValueRef) * (total + 1)), total, {0}};
+  int32_t *parent = (int32_t *)malloc(sizeof(int32_t) * (total + 1));
+  int64_t *weight = (int64_t *)calloc(total + 1, sizeof(int64_t));
+  int32_t i = 0;
+  for (v = LLVMGetFirstFunction(m); v; v = LLVMGetNextFunction(v), i++) {
+    index.values[i] = v;
+    weight[i] = 1;
+    for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(v); bb;
+         bb = LLVMGetNextBasicBlock(bb)) {
+      for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+           inst = LLVMGetNextInstruction(inst)) {
+        weight[i]++;
+      }
+    }
+  }
+  for (v = LLVMGetFirstGlobal(m); v; v = LLVMGetNextGlobal(v), i++) {
+    index.values[i] = v;
+    weight[i] = 1;
+  }
+  llvm_global_index_build(&index);
+  for (i = 0; i < total; i++) {
+    parent[i] = i;
+  }
+  // The first definition of each comdat, by comdat.
+  llvm_ptr_map comdats = {0};
+  for (i = 0; i < total; i++) {
+    v = index.values[i];
+    if (LLVMIsDeclaration(v)) {
+      continue;
+    }
+    LLVMLinkage linkage = LLVMGetLinkage(v);
+    if (linkage == LLVMInternalLinkage || linkage == LLVMPrivateLinkage) {
+      llvm_unite_users(&index, parent, i, v, 0);
+    }
+    LLVMComdatRef comdat = LLVMGetComdat(v);
+    if (comdat) {
+      void *first = llvm_ptr_map_get(&comdats, comdat);
+      if (first) {
+        llvm_uf_union(parent, i, (int32_t)(intptr_t)first - 1);
+      } else {
+        llvm_ptr_map_put(&comdats, comdat, (void *)(intptr_t)(i + 1));
+      }
+    }
+  }
+  free(comdats.keys);
+  free(comdats.values);
+
+  llvm_component *components =
+      (llvm_component *)calloc(total + 1, sizeof(llvm_component));
+  int32_t num_components = 0;
+  int64_t *component_weight = (int64_t *)calloc(total + 1, sizeof(int64_t));
+  for (i = 0; i < total; i++) {
+    if (!LLVMIsDeclaration(index.values[i])) {
+      component_weight[llvm_uf_find(parent, i)] += weight[i];
+    }
+  }
+  for (i = 0; i < total; i++) {
+    if (component_weight[i] > 0 && llvm_uf_find(parent, i) == i) {
+      components[num_components].root = i;
+      components[num_components].weight = component_weight[i];
+      num_components++;
+    }
+  }
+  qsort(components, num_components, sizeof(llvm_component),
+        llvm_component_cmp);
+
+  // Largest first, to the least loaded partition.
+  int32_t *component_part = (int32_t *)malloc(sizeof(int32_t) * (total + 1));
+  int64_t *load = (int64_t *)calloc(n, sizeof(int64_t));
+  for (i = 0; i < num_components; i++) {
+    int32_t best = 0;
+    for (int32_t p = 1; p < n; p++) {
+      if (load[p] < load[best]) {
+        best = p;
+      }
+    }
+    load[best] += components[i].weight;
+    component_part[components[i].root] = best;
+  }
+  for (i = 0; i < total; i++) {
+    v = index.values[i];
+    int32_t part = -1;
+    if (!LLVMIsDeclaration(v)) {
+      part = LLVMIsAGlobalVariable(v) &&
+                     LLVMGetLinkage(v) == LLVMAppendingLinkage
+                 ? 0
+                 : component_part[llvm_uf_find(parent, i)];
+    }
+    if (i < num_fns) {
+      fn_part[i] = part;
+    } else {
+      gv_part[i - num_fns] = part;
+    }
+  }
+  free(load);
+  free(component_part);
+  free(component_weight);
+  free(components);
+  free(weight);
+  free(parent);
+  llvm_global_index_free(&index);
+}
+
+static void llvm_pin_discardable(LLVMValueRef v) {
+  if (LLVMIsDeclaration(v)) {
+    return;
+  }
+  switch (LLVMGetLinkage(v)) {
+  case LLVMLinkOnceAnyLinkage:
+    LLVMSetLinkage(v, LLVMWeakAnyLinkage);
+    break;
+  case LLVMLinkOnceODRLinkage:
+    LLVMSetLinkage(v, LLVMWeakODRLinkage);
+    break;
+  default:
+    break;
+  }
+}
+
+// Flags in `imports` the external functions of `m`, outside of any comdat,
+// that are not flagged in `owned` but are called directly from one that is,
+// and have at most `limit` instructions: those worth a copy for inlining in
+// the partition of the owned ones. Both arrays have one entry per function, in module order.
+void __llvm_import_candidates(LLVMModuleRef m, uint8_t *owned, int32_t limit,
+                              uint8_t *imports) {
+  int32_t num_fns = 0;
+  LLVMValueRef v;
+  for (v = LLVMGetFirstFunction(m); v; v = LLVMGetNextFunction(v)) {
+    num_fns++;
+  }
+  llvm_global_index index = {
+      (LLVMValueRef *)malloc(sizeof(LLVMValueRef) * (num_fns + 1)), num_fns,
+      {0}};
+  int32_t i = 0;
+  for (v = LLVMGetFirstFunction(m); v; v = LLVMGetNextFunction(v), i++) {
+    index.values[i] = v;
+    imports[i] = 0;
+  }
+  llvm_global_index_build(&index);
+  for (i = 0; i < num_fns; i++) {
+    v = index.values[i];
+    if (owned[i] || LLVMIsDeclaration(v) || LLVMGetComdat(v) ||
+        LLVMGetLinkage(v) != LLVMExternalLinkage) {
+      continue;
+    }
+    int32_t size = 0;
+    for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(v); bb && size <= limit;
+         bb = LLVMGetNextBasicBlock(bb)) {
+      for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+           inst = LLVMGetNextInstruction(inst)) {
+        size++;
+      }
+    }
+    if (size > limit) {
+      continue;
+    }
+    for (LLVMUseRef use = LLVMGetFirstUse(v); use; use = LLVMGetNextUse(use)) {
+      LLVMValueRef user = LLVMGetUser(use);
+      if (!(LLVMIsACallInst(user) || LLVMIsAInvokeInst(user)) ||
+          LLVMGetCalledValue(user) != v) {
+        continue;
+      }
+      LLVMValueRef caller =
+          LLVMGetBasicBlockParent(LLVMGetInstructionParent(user));
+      int32_t j = llvm_global_index_of(&index, caller);
+      if (j >= 0 && owned[j]) {
+        imports[i] = 1;
+        break;
+      }
+    }
+  }
+  llvm_global_index_free(&index);
+}
+
+// Gives the linkonce definitions the matching weak linkage, so that the
+// partition owning one keeps it for the other partitions referring to it.
+void __llvm_pin_discardable(LLVMModuleRef m) {
+  LLVMValueRef v;
+  for (v = LLVMGetFirstFunction(m); v; v = LLVMGetNextFunction(v)) {
+    llvm_pin_discardable(v);
+  }
+  for (v = LLVMGetFirstGlobal(m); v; v = LLVMGetNextGlobal(v)) {
+    llvm_pin_discardable(v);
+  }
+}
+
+// Codegen
+
+typedef struct {
+  pthread_t thread;
+  LLVMMemoryBufferRef bitcode;
+  int opt_level;
+  char *passes;
+  int keep_bitcode;
+  LLVMMemoryBufferRef object;
+  LLVMMemoryBufferRef optimized;
+  char *error;
+} llvm_codegen_job;
+
+static void llvm_codegen_fail(char **error, const char *message) {
+  *error = strdup(message ? message : "unknown error");
+}
+
+// Runs `passes` (none if empty) over the module serialized in `bitcode` and
+// emits it at `opt_level` as a relocatable object for the host, in a context
+// of its own. Sets `*object`, and `*optimized` if `keep_bitcode`, or else
+// `*error`, all then owned by the caller.
+static void llvm_codegen_compile(LLVMMemoryBufferRef bitcode, int opt_level,
+                                 const char *passes, int keep_bitcode,
+                                 LLVMMemoryBufferRef *object,
+                                 LLVMMemoryBufferRef *optimized, char **error) {
+  LLVMContextRef ctx = LLVMContextCreate();
+  LLVMModuleRef m = NULL;
+  if (LLVMParseBitcodeInContext2(ctx, bitcode, &m)) {
+    llvm_codegen_fail(error, "invalid bitcode");
+    LLVMContextDispose(ctx);
+    return;
+  }
+  LLVMTargetMachineRef tm = llvm_create_host_target_machine(
+      opt_level, LLVMRelocPIC, LLVMCodeModelDefault);
+  if (!tm) {
+    llvm_codegen_fail(error, "host target is not available");
+    LLVMDisposeModule(m);
+    LLVMContextDispose(ctx);
+    return;
+  }
+  char *triple = LLVMGetTargetMachineTriple(tm);
+  LLVMSetTarget(m, triple);
+  LLVMDisposeMessage(triple);
+  LLVMTargetDataRef dl = LLVMCreateTargetDataLayout(tm);
+  LLVMSetModuleDataLayout(m, dl);
+  LLVMDisposeTargetData(dl);
+
+  LLVMErrorRef err = NULL;
+  if (*passes) {
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    err = LLVMRunPasses(m, passes, tm, options);
+    LLVMDisposePassBuilderOptions(options);
+  }
+  if (err) {
+    char *message = LLVMGetErrorMessage(err);
+    llvm_codegen_fail(error, message);
+    LLVMDisposeErrorMessage(message);
+  } else {
+    if (keep_bitcode) {
+      *optimized = LLVMWriteBitcodeToMemoryBuffer(m);
+    }
+    char *message = NULL;
+    if (LLVMTargetMachineEmitToMemoryBuffer(tm, m, LLVMObjectFile, &message,
+                                            object)) {
+      llvm_codegen_fail(error, message);
+      *object = NULL;
+    }
+    if (message) {
+      LLVMDisposeMessage(message);
+    }
+  }
+  LLVMDisposeTargetMachine(tm);
+  LLVMDisposeModule(m);
+  LLVMContextDispose(ctx);
+}
+
+static void *llvm_codegen_job_run(void *arg) {
+  llvm_codegen_job *job = (llvm_codegen_job *)arg;
+  llvm_codegen_compile(job->bitcode, job->opt_level, job->passes,
+                       job->keep_bitcode, &job->object, &job->optimized,
+                       &job->error);
+  return NULL;
+}
+
+// Runs `passes` (none if empty) over the module serialized in `bitcode` and
+// emits it at `opt_level` as a relocatable object for the host, on a
+// background thread with a context of its own. `bitcode` is only read, and
+// must stay alive until the job is joined.
+void *__llvm_codegen_job_start(void *bitcode, int32_t opt_level,
+                               const char *passes, int32_t keep_bitcode) {
+  llvm_codegen_job *job = (llvm_codegen_job *)calloc(1, sizeof(llvm_codegen_job));
+  job->bitcode = (LLVMMemoryBufferRef)bitcode;
+  job->opt_level = opt_level;
+  job->passes = strdup(passes);
+  job->keep_bitcode = keep_bitcode;
+  if (pthread_create(&job->thread, NULL, llvm_codegen_job_run, job) != 0) {
+    // No thread available, compile on the caller's thread instead.
+    llvm_codegen_job_run(job);
+    job->thread = pthread_self();
+  }
+  return job;
+}
+
+// Waits for the job. The object, the optimized bitcode and the error message
+// are then owned by the caller, the job itself is freed.
+void __llvm_codegen_job_join(void *job, void **object, void **optimized,
+                             char **error) {
+  llvm_codegen_job *j = (llvm_codegen_job *)job;
+  if (!pthread_equal(j->thread, pthread_self())) {
+    pthread_join(j->thread, NULL);
+  }
+  *object = j->object;
+  *optimized = j->optimized;
+  *error = j->error;
+  free(j->passes);
+  free(j);
+}
+
+// Compile service
+
+enum {
+  LLVM_COMPILE_QUEUED,
+  LLVM_COMPILE_RUNNING,
+  LLVM_COMPILE_DONE,
+  LLVM_COMPILE_FAILED,
+  LLVM_COMPILE_CANCELLED
+};
+
+typedef struct llvm_compile_service llvm_compile_service;
+
+typedef struct {
+  llvm_compile_service *service;
+  LLVMMemoryBufferRef bitcode;
+  int opt_level;
+  char *passes;
+  int32_t priority;
+  uint64_t seq;
+  int state;
+  // The handle, and the queue or the worker running the task.
+  int refs;
+  LLVMMemoryBufferRef object;
+  char *error;
+} llvm_compile_task;
+
+struct llvm_compile_service {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  // A binary heap, by priority then submission order.
+  llvm_compile_task **queue;
+  int32_t queued;
+  int32_t capacity;
+  uint64_t next_seq;
+  int stopping;
+  pthread_t *threads;
+  int32_t num_threads;
+  int32_t num_created;
+  int32_t num_started;
+  int32_t num_reserved;
+  // The owner, and the tasks not yet released.
+  int refs;
+};
+
+static int llvm_compile_task_before(llvm_compile_task *a,
+                                    llvm_compile_task *b) {
+  if (a->priority != b->priority) {
+    return a->priority > b->priority;
+  }
+  return a->seq < b->seq;
+}
+
+static void llvm_compile_queue_swap(llvm_compile_service *s, int32_t i,
+                                    int32_t j) {
+  llvm_compile_task *t = s->queue[i];
+  s->queue[i] = s->queue[j];
+  s->queue[j] = t;
+}
+
+static void llvm_compile_queue_sift_up(llvm_compile_service *s, int32_t i) {
+  while (i > 0) {
+    int32_t parent = (i - 1) / 2;
+    if (!llvm_compile_task_before(s->queue[i], s->queue[parent])) {
+      break;
+    }
+    llvm_compile_queue_swap(s, i, parent);
+    i = parent;
+  }
+}
+
+static void llvm_compile_queue_sift_down(llvm_compile_service *s, int32_t i) {
+  for (;;) {
+    int32_t first = i;
+    int32_t left = 2 * i + 1;
+    int32_t right = left + 1;
+    if (left < s->queued &&
+        llvm_compile_task_before(s->queue[left], s->queue[first])) {
+      first = left;
+    }
+    if (right < s->queued &&
+        llvm_compile_task_before(s->queue[right], s->queue[first])) {
+      first = right;
+    }
+    if (first == i) {
+      break;
+    }
+    llvm_compile_queue_swap(s, i, first);
+    i = first;
+  }
+}
+
+static void llvm_compile_queue_remove(llvm_compile_service *s, int32_t i) {
+  s->queued--;
+  if (i == s->queued) {
+    return;
+  }
+  s->queue[i] = s->queue[s->queued];
+  if (i > 0 && llvm_compile_task_before(s->queue[i], s->queue[(i - 1) / 2])) {
+    llvm_compile_queue_sift_up(s, i);
+  } else {
+    llvm_compile_queue_sift_down(s, i);
+  }
+}
+
+static void llvm_compile_service_destroy(llvm_compile_service *s) {
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->work);
+  pthread_cond_destroy(&s->done);
+  free(s->queue);
+  free(s->threads);
+  free(s);
+}
+
+// Drops a reference to the task, with the lock of its service held. Returns
+// whether that was the last reference to the service, which the caller then
+// destroys once it has released the lock.
+static int llvm_compile_task_release(llvm_compile_task *t) {
+  llvm_compile_service *s = t->service;
+  if (--t->refs > 0) {
+    return 0;
+  }
+  if (t->bitcode) {
+    LLVMDisposeMemoryBuffer(t->bitcode);
+  }
+  if (t->object) {
+    LLVMDisposeMemoryBuffer(t->object);
+  }
+  free(t->error);
+  free(t->passes);
+  free(t);
+  return --s->refs == 0;
+}
+
+static void llvm_compile_task_run(llvm_compile_task *t) {
+  LLVMMemoryBufferRef optimized = NULL;
+  llvm_codegen_compile(t->bitcode, t->opt_level, t->passes, 0, &t->object,
+                       &optimized, &t->error);
+  LLVMDisposeMemoryBuffer(t->bitcode);
+  t->bitcode = NULL;
+}
+
+static void *llvm_compile_worker(void *arg) {
+  llvm_compile_service *s = (llvm_compile_service *)arg;
+  pthread_mutex_lock(&s->lock);
+  // The last workers started only take tasks of a positive priority, so
+  // that these never wait for a batch of others to finish.
+  int reserved = s->num_started++ >= s->num_threads - s->num_reserved;
+  for (;;) {
+    while (!s->stopping &&
+           (s->queued == 0 || (reserved && s->queue[0]->priority <= 0))) {
+      pthread_cond_wait(&s->work, &s->lock);
+    }
+    if (s->stopping) {
+      break;
+    }
+    llvm_compile_task *t = s->queue[0];
+    llvm_compile_queue_remove(s, 0);
+    t->state = LLVM_COMPILE_RUNNING;
+    pthread_mutex_unlock(&s->lock);
+    llvm_compile_task_run(t);
+    pthread_mutex_lock(&s->lock);
+    t->state = t->error ? LLVM_COMPILE_FAILED : LLVM_COMPILE_DONE;
+    pthread_cond_broadcast(&s->done);
+    // The service is still owned until the workers are joined.
+    llvm_compile_task_release(t);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// Starts `threads` workers, the last `reserved` of them (at most all but
+// one) only compiling the tasks of a positive priority.
+void *__llvm_compile_service_new(int32_t threads, int32_t reserved) {
+  llvm_compile_service *s =
+      (llvm_compile_service *)calloc(1, sizeof(llvm_compile_service));
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->done, NULL);
+  s->refs = 1;
+  if (threads < 1) {
+    threads = 1;
+  }
+  s->num_reserved = reserved < 0 ? 0 : reserved < threads ? reserved : threads - 1;
+  s->num_threads = threads;
+  s->threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  // Workers that cannot be started are missing from the reserved ones
+  // first. Without any, tasks run on the thread submitting them.
+  while (s->num_created < threads &&
+         pthread_create(&s->threads[s->num_created], NULL, llvm_compile_worker,
+                        s) == 0) {
+    s->num_created++;
+  }
+  return s;
+}
+
+// Queues the compilation of the module serialized in `bitcode`, which the
+// task takes ownership of, as with `__llvm_codegen_job_start`. Tasks of a
+// higher priority are started first.
+void *__llvm_compile_service_submit(void *service, void *bitcode,
+                                    int32_t opt_level, const char *passes,
+                                    int32_t priority) {
+  llvm_compile_service *s = (llvm_compile_service *)service;
+  llvm_compile_task *t =
+      (llvm_compile_task *)calloc(1, sizeof(llvm_compile_task));
+  t->service = s;
+  t->bitcode = (LLVMMemoryBufferRef)bitcode;
+  t->opt_level = opt_level;
+  t->passes = strdup(passes);
+  t->priority = priority;
+  t->refs = 2;
+  pthread_mutex_lock(&s->lock);
+  s->refs++;
+  if (s->num_created == 0) {
+    pthread_mutex_unlock(&s->lock);
+    t->refs = 1;
+    llvm_compile_task_run(t);
+    t->state = t->error ? LLVM_COMPILE_FAILED : LLVM_COMPILE_DONE;
+    return t;
+  }
+  if (s->queued == s->capacity) {
+    s->capacity = s->capacity ? 2 * s->capacity : 16;
+    s->queue = (llvm_compile_task **)realloc(
+        s->queue, s->capacity * sizeof(llvm_compile_task *));
+  }
+  t->seq = s->next_seq++;
+  t->state = LLVM_COMPILE_QUEUED;
+  s->queue[s->queued++] = t;
+  llvm_compile_queue_sift_up(s, s->queued - 1);
+  // Wake every worker, as a reserved one may not take the task.
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+  return t;
+}
+
+int32_t __llvm_compile_task_state(void *task) {
+  llvm_compile_task *t = (llvm_compile_task *)task;
+  pthread_mutex_lock(&t->service->lock);
+  int32_t state = t->state;
+  pthread_mutex_unlock(&t->service->lock);
+  return state;
+}
+
+// Cancels the task if it has not started yet. A running task cannot be
+// interrupted, and is left to finish.
+int32_t __llvm_compile_task_cancel(void *task) {
+  llvm_compile_task *t = (llvm_compile_task *)task;
+  llvm_compile_service *s = t->service;
+  pthread_mutex_lock(&s->lock);
+  int32_t cancelled = 0;
+  if (t->state == LLVM_COMPILE_QUEUED) {
+    for (int32_t i = 0; i < s->queued; i++) {
+      if (s->queue[i] == t) {
+        llvm_compile_queue_remove(s, i);
+        break;
+      }
+    }
+    t->state = LLVM_COMPILE_CANCELLED;
+    pthread_cond_broadcast(&s->done);
+    llvm_compile_task_release(t);
+    cancelled = 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return cancelled;
+}
+
+// Waits for the task to finish or be cancelled, and frees it. The object
+// and the error message are then owned by the caller.
+int32_t __llvm_compile_task_wait(void *task, void **object, char **error) {
+  llvm_compile_task *t = (llvm_compile_task *)task;
+  llvm_compile_service *s = t->service;
+  pthread_mutex_lock(&s->lock);
+  while (t->state == LLVM_COMPILE_QUEUED || t->state == LLVM_COMPILE_RUNNING) {
+    pthread_cond_wait(&s->done, &s->lock);
+  }
+  int32_t state = t->state;
+  *object = t->object;
+  *error = t->error;
+  t->object = NULL;
+  t->error = NULL;
+  int last = llvm_compile_task_release(t);
+  pthread_mutex_unlock(&s->lock);
+  if (last) {
+    llvm_compile_service_destroy(s);
+  }
+  return state;
+}
+
+// Cancels the queued tasks, waits for the running ones and stops the
+// workers. The tasks can still be waited for, and the service is freed with
+// the last of them.
+void __llvm_compile_service_free(void *service) {
+  llvm_compile_service *s = (llvm_compile_service *)service;
+  pthread_mutex_lock(&s->lock);
+  s->stopping = 1;
+  while (s->queued > 0) {
+    llvm_compile_task *t = s->queue[--s->queued];
+    t->state = LLVM_COMPILE_CANCELLED;
+    llvm_compile_task_release(t);
+  }
+  pthread_cond_broadcast(&s->work);
+  pthread_cond_broadcast(&s->done);
+  pthread_mutex_unlock(&s->lock);
+  for (int32_t i = 0; i < s->num_created; i++) {
+    pthread_join(s->threads[i], NULL);
+  }
+  pthread_mutex_lock(&s->lock);
+  int last = --s->refs == 0;
+  pthread_mutex_unlock(&s->lock);
+  if (last) {
+    llvm_compile_service_destroy(s);
+  }
+}
+
+void __llvm_copy_buffer(void *mem_buf, uint8_t *out) {
+  memcpy(out, LLVMGetBufferStart((LLVMMemoryBufferRef)mem_buf),
+         LLVMGetBufferSize((LLVMMemoryBufferRef)mem_buf));
+}
+
+void *__llvm_create_memory_buffer_from_bytes(uint8_t *data, int32_t len,
+                                             const char *name) {
+  return LLVMCreateMemoryBufferWithMemoryRangeCopy((const char *)data,
+                                                   (size_t)len, name);
+}
+
+// Objects
+
+// Counts the sections and the symbols of the object file `br`, and the
+// relocations of each section when `relocs` is not NULL.
+static void llvm_object_count(LLVMBinaryRef br, int32_t *num_sections,
+                              int32_t *num_symbols, int32_t *relocs) {
+  *num_sections = 0;
+  *num_symbols = 0;
+  LLVMSectionIteratorRef si = LLVMObjectFileCopySectionIterator(br);
+  for (; si && !LLVMObjectFileIsSectionIteratorAtEnd(br, si);
+       LLVMMoveToNextSection(si)) {
+    if (relocs) {
+      int32_t n = 0;
+      LLVMRelocationIteratorRef ri = LLVMGetRelocations(si);
+      for (; !LLVMIsRelocationIteratorAtEnd(si, ri);
+           LLVMMoveToNextRelocation(ri)) {
+        n++;
+      }
+      LLVMDisposeRelocationIterator(ri);
+      relocs[*num_sections] = n;
+    }
+    (*num_sections)++;
+  }
+  if (si) {
+    LLVMDisposeSectionIterator(si);
+  }
+  LLVMSymbolIteratorRef sym = LLVMObjectFileCopySymbolIterator(br);
+  for (; sym && !LLVMObjectFileIsSymbolIteratorAtEnd(br, sym);
+       LLVMMoveToNextSymbol(sym)) {
+    (*num_symbols)++;
+  }
+  if (sym) {
+    LLVMDisposeSymbolIterator(sym);
+  }
+}
+
+void __llvm_object_counts(LLVMBinaryRef br, int32_t *counts) {
+  llvm_object_count(br, &counts[0], &counts[1], NULL);
+}
+
+// Appends `name` and a '\0' to the `names` buffer of `*len` bytes and
+// `*cap` capacity.
+static void llvm_append_name(char **names, size_t *len, size_t *cap,
+                             const char *name) {
+  size_t n = name ? strlen(name) : 0;
+  if (*len + n + 1 > *cap) {
+    while (*len + n + 1 > *cap) {
+      *cap = *cap ? *cap * 2 : 256;
+    }
+    *names = (char *)realloc(*names, *cap);
+  }
+  memcpy(*names + *len, name, n);
+  (*names)[*len + n] = '\0';
+  *len += n + 1;
+}
+
+static moonbit_string_t llvm_take_names(char *names, size_t len) {
+  moonbit_string_t ms = c_str_to_moonbit_str_with_length(names, len);
+  free(names);
+  return ms;
+}
+
+// Fills the address, size and relocation count of each section of `br`, in
+// order, and returns their names, each followed by a '\0'.
+moonbit_string_t __llvm_object_sections(LLVMBinaryRef br, uint64_t *addrs,
+                                        uint64_t *sizes, int32_t *relocs) {
+  int32_t num_sections, num_symbols;
+  llvm_object_count(br, &num_sections, &num_symbols, relocs);
+  char *names = NULL;
+  size_t len = 0, cap = 0;
+  int32_t i = 0;
+  LLVMSectionIteratorRef si = LLVMObjectFileCopySectionIterator(br);
+  for (; si && !LLVMObjectFileIsSectionIteratorAtEnd(br, si);
+       LLVMMoveToNextSection(si), i++) {
+    addrs[i] = LLVMGetSectionAddress(si);
+    sizes[i] = LLVMGetSectionSize(si);
+    llvm_append_name(&names, &len, &cap, LLVMGetSectionName(si));
+  }
+  if (si) {
+    LLVMDisposeSectionIterator(si);
+  }
+  return llvm_take_names(names, len);
+}
+
+// What tells the sections of an object apart, there being no way to compare
+// section iterators: where their name and contents are, and their address
+// and size.
+typedef struct {
+  const char *name;
+  const char *contents;
+  uint64_t address;
+  uint64_t size;
+  int32_t index;
+} llvm_section_key;
+
+static llvm_section_key llvm_section_key_of(LLVMSectionIteratorRef si,
+                                            int32_t index) {
+  llvm_section_key key = {LLVMGetSectionName(si), LLVMGetSectionContents(si),
+                          LLVMGetSectionAddress(si), LLVMGetSectionSize(si),
+                          index};
+  return key;
+}
+
+static int llvm_section_key_cmp(const void *a, const void *b) {
+  const llvm_section_key *x = (const llvm_section_key *)a;
+  const llvm_section_key *y = (const llvm_section_key *)b;
+  if (x->name != y->name) {
+    return x->name < y->name ? -1 : 1;
+  }
+  if (x->contents != y->contents) {
+    return x->contents < y->contents ? -1 : 1;
+  }
+  if (x->address != y->address) {
+    return x->address < y->address ? -1 : 1;
+  }
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  return 0;
+}
+
+// Fills the address, size and section index (-1 for undefined and absolute
+// symbols) of each symbol of `br`, in order, and returns their names, each
+// followed by a '\0'.
+moonbit_string_t __llvm_object_symbols(LLVMBinaryRef br, uint64_t *addrs,
+                                       uint64_t *sizes, int32_t *sections) {
+  int32_t num_sections, num_symbols;
+  llvm_object_count(br, &num_sections, &num_symbols, NULL);
+  llvm_section_key *keys =
+      (llvm_section_key *)malloc(sizeof(llvm_section_key) * (num_sections + 1));
+  LLVMSectionIteratorRef si = LLVMObjectFileCopySectionIterator(br);
+  for (int32_t i = 0; i < num_sections; i++) {
+    keys[i] = llvm_section_key_of(si, i);
+    LLVMMoveToNextSection(si);
+  }
+  qsort(keys, num_sections, sizeof(llvm_section_key), llvm_section_key_cmp);
+
+  char *names = NULL;
+  size_t len = 0, cap = 0;
+  int32_t i = 0;
+  LLVMSymbolIteratorRef sym = LLVMObjectFileCopySymbolIterator(br);
+  for (; sym && !LLVMObjectFileIsSymbolIteratorAtEnd(br, sym);
+       LLVMMoveToNextSymbol(sym), i++) {
+    addrs[i] = LLVMGetSymbolAddress(sym);
+    sizes[i] = LLVMGetSymbolSize(sym);
+    llvm_append_name(&names, &len, &cap, LLVMGetSymbolName(sym));
+    sections[i] = -1;
+    if (!si) {
+      continue;
+    }
+    LLVMMoveToContainingSection(si, sym);
+    if (LLVMObjectFileIsSectionIteratorAtEnd(br, si)) {
+      continue;
+    }
+    llvm_section_key key = llvm_section_key_of(si, -1);
+    llvm_section_key *found = (llvm_section_key *)bsearch(
+        &key, keys, num_sections, sizeof(llvm_section_key),
+        llvm_section_key_cmp);
+    if (found) {
+      sections[i] = found->index;
+    }
+  }
+  if (sym) {
+    LLVMDisposeSymbolIterator(sym);
+  }
+  if (si) {
+    LLVMDisposeSectionIterator(si);
+  }
+  free(keys);
+  return llvm_take_names(names, len);
+}
+
+// The number of bytes of the section `si` of `br` held in the file: none for
+// virtual sections, such as `.bss`, whose contents LLVM places at the start of
+// the file, where the headers are.
+int64_t __llvm_section_contents_size(LLVMBinaryRef br,
+                                     LLVMSectionIteratorRef si) {
+  LLVMMemoryBufferRef buf = LLVMBinaryCopyMemoryBuffer(br);
+  const char *start = LLVMGetBufferStart(buf);
+  const char *end = start + LLVMGetBufferSize(buf);
+  LLVMDisposeMemoryBuffer(buf);
+  const char *contents = LLVMGetSectionContents(si);
+  uint64_t size = LLVMGetSectionSize(si);
+  if (!contents || contents <= start || contents > end ||
+      size > (uint64_t)(end - contents)) {
+    return 0;
+  }
+  return (int64_t)size;
+}
+
+void __llvm_copy_section_contents(LLVMSectionIteratorRef si, uint8_t *out,
+                                  int32_t len) {
+  memcpy(out, LLVMGetSectionContents(si), (size_t)len);
+}
+
+// Layouts
+
+// Writes the offset of each element of the struct type `ty`, then its size
+// and its alignment, to `out`.
+void __llvm_struct_layout(LLVMTargetDataRef td, LLVMTypeRef ty,
+                          uint64_t *out) {
+  unsigned n = LLVMCountStructElementTypes(ty);
+  for (unsigned i = 0; i < n; i++) {
+    out[i] = LLVMOffsetOfElement(td, ty, i);
+  }
+  out[n] = LLVMABISizeOfType(td, ty);
+  out[n + 1] = LLVMABIAlignmentOfType(td, ty);
+}
+
+// Memory usage
+
+enum {
+  LLVM_USAGE_MODULES,
+  LLVM_USAGE_FUNCTIONS,
+  LLVM_USAGE_BASIC_BLOCKS,
+  LLVM_USAGE_INSTRUCTIONS,
+  LLVM_USAGE_GLOBALS,
+  LLVM_USAGE_TYPES,
+  LLVM_USAGE_CONSTANTS,
+  LLVM_USAGE_METADATA,
+  LLVM_USAGE_BYTES,
+  // The part of the bytes owned by the context.
+  LLVM_USAGE_CONTEXT_BYTES
+};
+
+// Rough sizes of LLVM's objects on a 64-bit host, for the estimate.
+enum {
+  LLVM_SIZE_MODULE = 800,
+  LLVM_SIZE_FUNCTION = 128,
+  LLVM_SIZE_ARGUMENT = 40,
+  LLVM_SIZE_BASIC_BLOCK = 80,
+  LLVM_SIZE_INSTRUCTION = 64,
+  LLVM_SIZE_USE = 32,
+  LLVM_SIZE_GLOBAL = 96,
+  LLVM_SIZE_TYPE = 32,
+  LLVM_SIZE_TYPE_ELEMENT = 8,
+  LLVM_SIZE_CONSTANT = 48,
+  LLVM_SIZE_MD_NODE = 32,
+  LLVM_SIZE_MD_OPERAND = 8,
+  LLVM_SIZE_MD_STRING = 24,
+  LLVM_SIZE_NAME = 16
+};
+
+// A set of pointers, by open addressing.
+typedef struct {
+  const void **slots;
+  size_t capacity;
+  size_t count;
+} llvm_ptr_set;
+
+// Adds `p` to the set, and returns whether it was not there yet.
+static int llvm_ptr_set_add(llvm_ptr_set *set, const void *p) {
+  if (2 * (set->count + 1) > set->capacity) {
+    size_t capacity = set->capacity ? 2 * set->capacity : 64;
+    const void **slots = (const void **)calloc(capacity, sizeof(void *));
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (set->slots[i]) {
+        size_t j = llvm_ptr_slot(set->slots[i], capacity);
+        while (slots[j]) {
+          j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = set->slots[i];
+      }
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+  }
+  size_t j = llvm_ptr_slot(p, set->capacity);
+  while (set->slots[j]) {
+    if (set->slots[j] == p) {
+      return 0;
+    }
+    j = (j + 1) & (set->capacity - 1);
+  }
+  set->slots[j] = p;
+  set->count++;
+  return 1;
+}
+
+typedef struct {
+  int64_t *counts;
+  llvm_ptr_set types;
+  llvm_ptr_set constants;
+  llvm_ptr_set metadata;
+} llvm_usage;
+
+// Adds `bytes` taken by a type, a constant or metadata, owned by the context.
+static void llvm_usage_uniqued(llvm_usage *u, size_t bytes) {
+  u->counts[LLVM_USAGE_BYTES] += bytes;
+  u->counts[LLVM_USAGE_CONTEXT_BYTES] += bytes;
+}
+
+static void llvm_usage_name(llvm_usage *u, LLVMValueRef v) {
+  size_t len = 0;
+  LLVMGetValueName2(v, &len);
+  if (len) {
+    u->counts[LLVM_USAGE_BYTES] += LLVM_SIZE_NAME + len;
+  }
+}
+
+static void llvm_usage_type(llvm_usage *u, LLVMTypeRef ty) {
+  if (!ty || !llvm_ptr_set_add(&u->types, ty)) {
+    return;
+  }
+  unsigned n = LLVMGetNumContainedTypes(ty);
+  u->counts[LLVM_USAGE_TYPES]++;
+  llvm_usage_uniqued(u, LLVM_SIZE_TYPE + n * LLVM_SIZE_TYPE_ELEMENT);
+  if (LLVMGetTypeKind(ty) == LLVMStructTypeKind && LLVMGetStructName(ty)) {
+    llvm_usage_uniqued(u, LLVM_SIZE_NAME + strlen(LLVMGetStructName(ty)));
+  }
+  if (n == 0) {
+    return;
+  }
+  LLVMTypeRef *elements = (LLVMTypeRef *)malloc(n * sizeof(LLVMTypeRef));
+  LLVMGetSubtypes(ty, elements);
+  for (unsigned i = 0; i < n; i++) {
+    llvm_usage_type(u, elements[i]);
+  }
+  free(elements);
+}
+
+static void llvm_usage_metadata(llvm_usage *u, LLVMMetadataRef md);
+
+// Counts the operand `v` of an instruction, a constant or a metadata node,
+// unless it is counted elsewhere: instructions, arguments, blocks and
+// global values are counted with their module.
+static void llvm_usage_operand(llvm_usage *u, LLVMValueRef v) {
+  if (!v || LLVMIsAGlobalValue(v)) {
+    return;
+  }
+  if (LLVMGetValueKind(v) == LLVMMetadataAsValueValueKind) {
+    // The wrapper exists already, as the operand of `v`'s user.
+    llvm_usage_metadata(u, LLVMValueAsMetadata(v));
+    return;
+  }
+  if (!LLVMIsAConstant(v) || !llvm_ptr_set_add(&u->constants, v)) {
+    return;
+  }
+  int n = LLVMGetNumOperands(v);
+  u->counts[LLVM_USAGE_CONSTANTS]++;
+  llvm_usage_uniqued(u, LLVM_SIZE_CONSTANT + n * LLVM_SIZE_USE);
+  if (LLVMIsConstantString(v)) {
+    size_t len = 0;
+    LLVMGetAsString(v, &len);
+    llvm_usage_uniqued(u, len);
+  }
+  llvm_usage_type(u, LLVMTypeOf(v));
+  for (int i = 0; i < n; i++) {
+    llvm_usage_operand(u, LLVMGetOperand(v, i));
+  }
+}
+
+// Counts the metadata `md`. The C API only reads the operands of a node or
+// the bytes of a string through a value wrapping it, and the context keeps
+// every wrapper for good, so measuring would grow what it measures. Nodes
+// are then counted without their operands, except for the scope and the
+// inlined-at location of debug locations, which have getters of their own.
+static void llvm_usage_metadata(llvm_usage *u, LLVMMetadataRef md) {
+  if (!md || !llvm_ptr_set_add(&u->metadata, md)) {
+    return;
+  }
+  u->counts[LLVM_USAGE_METADATA]++;
+  switch (LLVMGetMetadataKind(md)) {
+  case LLVMMDStringMetadataKind:
+    llvm_usage_uniqued(u, LLVM_SIZE_MD_STRING);
+    break;
+  case LLVMDILocationMetadataKind:
+    llvm_usage_uniqued(u, LLVM_SIZE_MD_NODE + 2 * LLVM_SIZE_MD_OPERAND);
+    llvm_usage_metadata(u, LLVMDILocationGetScope(md));
+    llvm_usage_metadata(u, LLVMDILocationGetInlinedAt(md));
+    break;
+  default:
+    llvm_usage_uniqued(u, LLVM_SIZE_MD_NODE);
+    break;
+  }
+}
+
+// Counts the metadata attached to the function or global variable `gv`.
+static void llvm_usage_global_metadata(llvm_usage *u, LLVMValueRef gv) {
+  size_t n = 0;
+  LLVMValueMetadataEntry *entries = LLVMGlobalCopyAllMetadata(gv, &n);
+  for (size_t i = 0; i < n; i++) {
+    llvm_usage_metadata(u, LLVMValueMetadataEntriesGetMetadata(entries, i));
+  }
+  if (entries) {
+    LLVMDisposeValueMetadataEntries(entries);
+  }
+}
+
+static void llvm_usage_instruction(llvm_usage *u, LLVMValueRef inst) {
+  int n = LLVMGetNumOperands(inst);
+  u->counts[LLVM_USAGE_INSTRUCTIONS]++;
+  u->counts[LLVM_USAGE_BYTES] += LLVM_SIZE_INSTRUCTION + n * LLVM_SIZE_USE;
+  llvm_usage_name(u, inst);
+  llvm_usage_type(u, LLVMTypeOf(inst));
+  for (int i = 0; i < n; i++) {
+    llvm_usage_operand(u, LLVMGetOperand(inst, i));
+  }
+  llvm_usage_metadata(u, LLVMInstructionGetDebugLoc(inst));
+  size_t num_entries = 0;
+  LLVMValueMetadataEntry *entries =
+      LLVMInstructionGetAllMetadataOtherThanDebugLoc(inst, &num_entries);
+  for (size_t i = 0; i < num_entries; i++) {
+    llvm_usage_metadata(u, LLVMValueMetadataEntriesGetMetadata(entries, i));
+  }
+  if (entries) {
+    LLVMDisposeValueMetadataEntries(entries);
+  }
+}
+
+static void llvm_usage_module(llvm_usage *u, LLVMModuleRef m) {
+  int64_t *counts = u->counts;
+  counts[LLVM_USAGE_MODULES]++;
+  counts[LLVM_USAGE_BYTES] += LLVM_SIZE_MODULE;
+  for (LLVMValueRef f = LLVMGetFirstFunction(m); f;
+       f = LLVMGetNextFunction(f)) {
+    unsigned num_params = LLVMCountParams(f);
+    counts[LLVM_USAGE_FUNCTIONS]++;
+    counts[LLVM_USAGE_BYTES] +=
+        LLVM_SIZE_FUNCTION + num_params * LLVM_SIZE_ARGUMENT;
+    llvm_usage_name(u, f);
+    llvm_usage_type(u, LLVMGlobalGetValueType(f));
+    llvm_usage_global_metadata(u, f);
+    for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(f); bb;
+         bb = LLVMGetNextBasicBlock(bb)) {
+      counts[LLVM_USAGE_BASIC_BLOCKS]++;
+      counts[LLVM_USAGE_BYTES] += LLVM_SIZE_BASIC_BLOCK;
+      for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+           inst = LLVMGetNextInstruction(inst)) {
+        llvm_usage_instruction(u, inst);
+      }
+    }
+  }
+  for (LLVMValueRef gv = LLVMGetFirstGlobal(m); gv;
+       gv = LLVMGetNextGlobal(gv)) {
+    counts[LLVM_USAGE_GLOBALS]++;
+    counts[LLVM_USAGE_BYTES] += LLVM_SIZE_GLOBAL;
+    llvm_usage_name(u, gv);
+    llvm_usage_type(u, LLVMGlobalGetValueType(gv));
+    llvm_usage_operand(u, LLVMGetInitializer(gv));
+    llvm_usage_global_metadata(u, gv);
+  }
+  for (LLVMNamedMDNodeRef nmd = LLVMGetFirstNamedMetadata(m); nmd;
+       nmd = LLVMGetNextNamedMetadata(nmd)) {
+    size_t len = 0;
+    const char *name = LLVMGetNamedMetadataName(nmd, &len);
+    char *key = strndup(name, len);
+    // The operands are only read wrapped as values, so they are not
+    // counted, as for the operands of nodes.
+    unsigned n = LLVMGetNamedMetadataNumOperands(m, key);
+    counts[LLVM_USAGE_BYTES] +=
+        LLVM_SIZE_NAME + len + n * LLVM_SIZE_MD_OPERAND;
+    free(key);
+  }
+}
+
+// Counts the functions, basic blocks, instructions and global variables of
+// the `n` modules `mods`, all of the same context, and the distinct types,
+// constants and metadata they use, which the context owns and shares
+// between them. Writes these to `counts` in the order of `LLVM_USAGE_*`,
+// along with an estimate of the bytes they take, and of those taken by the
+// types, constants and metadata alone.
+void __llvm_memory_usage(LLVMModuleRef *mods, int32_t n, int64_t *counts) {
+  llvm_usage u;
+  memset(&u, 0, sizeof(u));
+  memset(counts, 0, (LLVM_USAGE_CONTEXT_BYTES + 1) * sizeof(int64_t));
+  u.counts = counts;
+  for (int32_t i = 0; i < n; i++) {
+    llvm_usage_module(&u, mods[i]);
+  }
+  free(u.types.slots);
+  free(u.constants.slots);
+  free(u.metadata.slots);
+}
+
+// Recorded IR
+
+enum {
+  LLVM_REC_VOID,
+  LLVM_REC_I1,
+  LLVM_REC_I8,
+  LLVM_REC_I16,
+  LLVM_REC_I32,
+  LLVM_REC_I64,
+  LLVM_REC_FLOAT,
+  LLVM_REC_DOUBLE,
+  LLVM_REC_PTR
+};
+
+enum {
+  LLVM_REC_CONST_INT,
+  LLVM_REC_CONST_FP,
+  LLVM_REC_BINOP,
+  LLVM_REC_ICMP,
+  LLVM_REC_FCMP,
+  LLVM_REC_CAST,
+  LLVM_REC_SELECT,
+  LLVM_REC_PHI,
+  LLVM_REC_INCOMING,
+  LLVM_REC_ALLOCA,
+  LLVM_REC_LOAD,
+  LLVM_REC_STORE,
+  LLVM_REC_CALL,
+  LLVM_REC_BR,
+  LLVM_REC_COND_BR,
+  LLVM_REC_RET,
+  LLVM_REC_RET_VOID,
+  LLVM_REC_UNREACHABLE
+};
+
+static const LLVMOpcode llvm_rec_binops[] = {
+    LLVMAdd,  LLVMSub,  LLVMMul,  LLVMUDiv, LLVMSDiv, LLVMURem,
+    LLVMSRem, LLVMFAdd, LLVMFSub, LLVMFMul, LLVMFDiv, LLVMFRem,
+    LLVMShl,  LLVMLShr, LLVMAShr, LLVMAnd,  LLVMOr,   LLVMXor};
+
+static const LLVMOpcode llvm_rec_casts[] = {
+    LLVMTrunc,  LLVMZExt,   LLVMSExt,   LLVMFPTrunc,  LLVMFPExt,    LLVMFPToSI,
+    LLVMFPToUI, LLVMSIToFP, LLVMUIToFP, LLVMPtrToInt, LLVMIntToPtr, LLVMBitCast};
+
+static LLVMTypeRef llvm_rec_type(LLVMContextRef ctx, int64_t ty) {
+  switch (ty) {
+  case LLVM_REC_I1:
+    return LLVMInt1TypeInContext(ctx);
+  case LLVM_REC_I8:
+    return LLVMInt8TypeInContext(ctx);
+  case LLVM_REC_I16:
+    return LLVMInt16TypeInContext(ctx);
+  case LLVM_REC_I32:
+    return LLVMInt32TypeInContext(ctx);
+  case LLVM_REC_I64:
+    return LLVMInt64TypeInContext(ctx);
+  case LLVM_REC_FLOAT:
+    return LLVMFloatTypeInContext(ctx);
+  case LLVM_REC_DOUBLE:
+    return LLVMDoubleTypeInContext(ctx);
+  case LLVM_REC_PTR:
+    return LLVMPointerTypeInContext(ctx, 0);
+  default:
+    return LLVMVoidTypeInContext(ctx);
+  }
+}
+
+// Returns the function type of the signature `sig`: the result type, the
+// number of parameters, then their types.
+static LLVMTypeRef llvm_rec_function_type(LLVMContextRef ctx,
+                                          const int64_t *sig) {
+  int32_t n = (int32_t)sig[1];
+  LLVMTypeRef *params = (LLVMTypeRef *)malloc((n + 1) * sizeof(LLVMTypeRef));
+  for (int32_t i = 0; i < n; i++) {
+    params[i] = llvm_rec_type(ctx, sig[2 + i]);
+  }
+  LLVMTypeRef ty =
+      LLVMFunctionType(llvm_rec_type(ctx, sig[0]), params, n, 0);
+  free(params);
+  return ty;
+}
+
+static int llvm_rec_type_ok(int64_t ty) {
+  return ty >= LLVM_REC_VOID && ty <= LLVM_REC_PTR;
+}
+
+// Whether the signature `sig` of `len` codes is well formed, as for
+// `llvm_rec_function_type`.
+static int llvm_rec_signature_ok(const int64_t *sig, int64_t len) {
+  if (len < 2 || !llvm_rec_type_ok(sig[0]) || sig[1] < 0 ||
+      sig[1] > len - 2) {
+    return 0;
+  }
+  for (int64_t i = 0; i < sig[1]; i++) {
+    if (sig[2 + i] == LLVM_REC_VOID || !llvm_rec_type_ok(sig[2 + i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Returns the value numbered `id` of the `num_values` in `values`, or NULL
+// if there is none or it is void, so it cannot be an operand.
+static LLVMValueRef llvm_rec_operand(LLVMValueRef *values, int32_t num_values,
+                                     int64_t id) {
+  if (id < 0 || id >= num_values || !values[id] ||
+      LLVMGetTypeKind(LLVMTypeOf(values[id])) == LLVMVoidTypeKind) {
+    return NULL;
+  }
+  return values[id];
+}
+
+// Builds the function recorded in `code` into `m`, in one pass, and returns
+// it, or NULL with `*error` set. `names` holds `num_names` names, each ended
+// by '\0': the function's, then those of the functions it calls.
+//
+// `code` starts with the signature of the function, as for
+// `llvm_rec_function_type`, and its number of blocks. Then comes a record
+// per constant or instruction, in the order they were recorded: the op, the
+// block (-1 for a constant), the result type, the number of operands, then
+// the operands. Each record defines the value numbered after it, the
+// parameters coming first; a record of no value still takes a number.
+//
+// A malformed record fails the build rather than the process, and a failed
+// build leaves `m` as it was, without the declarations of the callees it
+// added.
+static LLVMValueRef llvm_rec_build(LLVMModuleRef m, const int64_t *code,
+                                   int32_t len, const char *names,
+                                   int32_t num_names, char **error) {
+  LLVMContextRef ctx = LLVMGetModuleContext(m);
+  if (num_names < 1 || len < 3 || !llvm_rec_signature_ok(code, len - 1) ||
+      code[2 + code[1]] < 0) {
+    llvm_codegen_fail(error, "the recorded signature is malformed");
+    return NULL;
+  }
+  const char **name = (const char **)malloc(num_names * sizeof(char *));
+  for (int32_t i = 0; i < num_names; i++) {
+    name[i] = names;
+    names += strlen(names) + 1;
+  }
+  LLVMValueRef decl = LLVMGetNamedFunction(m, name[0]);
+  if (decl && !LLVMIsDeclaration(decl)) {
+    llvm_codegen_fail(error, "the function is already defined");
+    free(name);
+    return NULL;
+  }
+  // The function is built unnamed, and only replaces the declaration if
+  // there is one once it is verified.
+  int32_t num_params = (int32_t)code[1];
+  LLVMValueRef fn = LLVMAddFunction(m, "", llvm_rec_function_type(ctx, code));
+  int32_t pos = 2 + num_params;
+  int32_t num_blocks = (int32_t)code[pos++];
+  LLVMBasicBlockRef *blocks =
+      (LLVMBasicBlockRef *)malloc((num_blocks + 1) * sizeof(LLVMBasicBlockRef));
+  for (int32_t i = 0; i < num_blocks; i++) {
+    blocks[i] = LLVMAppendBasicBlockInContext(ctx, fn, "");
+  }
+  int32_t num_values = num_params;
+  int32_t capacity = num_params + 64;
+  LLVMValueRef *values = (LLVMValueRef *)malloc(capacity * sizeof(LLVMValueRef));
+  for (int32_t i = 0; i < num_params; i++) {
+    values[i] = LLVMGetParam(fn, i);
+  }
+  // The declarations added for callees the module lacked.
+  LLVMValueRef *added = (LLVMValueRef *)malloc(num_names * sizeof(LLVMValueRef));
+  int32_t num_added = 0;
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+  int64_t current = -1;
+  const char *fail = NULL;
+  while (pos < len && !fail) {
+    if (len - pos < 4 || code[pos + 3] < 0 || code[pos + 3] > len - pos - 4 ||
+        code[pos + 1] < -1 || code[pos + 1] >= num_blocks ||
+        !llvm_rec_type_ok(code[pos + 2])) {
+      fail = "a recorded instruction is malformed";
+      break;
+    }
+    int64_t op = code[pos];
+    int64_t block = code[pos + 1];
+    int64_t ty_code = code[pos + 2];
+    LLVMTypeRef ty = llvm_rec_type(ctx, ty_code);
+    int32_t n = (int32_t)code[pos + 3];
+    const int64_t *a = code + pos + 4;
+    pos += 4 + n;
+    if (op > LLVM_REC_CONST_FP && op != LLVM_REC_INCOMING && block < 0) {
+      fail = "a recorded instruction is outside of any block";
+      break;
+    }
+    if (block >= 0 && block != current) {
+      LLVMPositionBuilderAtEnd(b, blocks[block]);
+      current = block;
+    }
+    // The operands each op reads from `a`, checked before it is built.
+    LLVMValueRef x = NULL, y = NULL, z = NULL;
+    LLVMValueRef v = NULL;
+    switch (op) {
+    case LLVM_REC_CONST_INT:
+      if (n != 1 || LLVMGetTypeKind(ty) != LLVMIntegerTypeKind) {
+        fail = "a recorded constant is malformed";
+        break;
+      }
+      v = LLVMConstInt(ty, (unsigned long long)a[0], 0);
+      break;
+    case LLVM_REC_CONST_FP: {
+      if (n != 1 || (ty_code != LLVM_REC_FLOAT && ty_code != LLVM_REC_DOUBLE)) {
+        fail = "a recorded constant is malformed";
+        break;
+      }
+      double d;
+      memcpy(&d, &a[0], sizeof(d));
+      v = LLVMConstReal(ty, d);
+      break;
+    }
+    case LLVM_REC_BINOP:
+      if (n != 3 || a[0] < 0 ||
+          a[0] >= (int64_t)(sizeof(llvm_rec_binops) / sizeof(LLVMOpcode)) ||
+          !(x = llvm_rec_operand(values, num_values, a[1])) ||
+          !(y = llvm_rec_operand(values, num_values, a[2])) ||
+          LLVMTypeOf(x) != LLVMTypeOf(y)) {
+        fail = "a recorded binary operation is malformed";
+        break;
+      }
+      v = LLVMBuildBinOp(b, llvm_rec_binops[a[0]], x, y, "");
+      break;
+    case LLVM_REC_ICMP:
+      if (n != 3 || a[0] < 0 || a[0] > LLVMIntSLE - LLVMIntEQ ||
+          !(x = llvm_rec_operand(values, num_values, a[1])) ||
+          !(y = llvm_rec_operand(values, num_values, a[2])) ||
+          LLVMTypeOf(x) != LLVMTypeOf(y)) {
+        fail = "a recorded comparison is malformed";
+        break;
+      }
+      v = LLVMBuildICmp(b, (LLVMIntPredicate)(LLVMIntEQ + a[0]), x, y, "");
+      break;
+    case LLVM_REC_FCMP:
+      if (n != 3 || a[0] < LLVMRealPredicateFalse ||
+          a[0] > LLVMRealPredicateTrue ||
+          !(x = llvm_rec_operand(values, num_values, a[1])) ||
+          !(y = llvm_rec_operand(values, num_values, a[2])) ||
+          LLVMTypeOf(x) != LLVMTypeOf(y)) {
+        fail = "a recorded comparison is malformed";
+        break;
+      }
+      v = LLVMBuildFCmp(b, (LLVMRealPredicate)a[0], x, y, "");
+      break;
+    case LLVM_REC_CAST:
+      if (n != 2 || a[0] < 0 ||
+          a[0] >= (int64_t)(sizeof(llvm_rec_casts) / sizeof(LLVMOpcode)) ||
+          ty_code == LLVM_REC_VOID ||
+          !(x = llvm_rec_operand(values, num_values, a[1]))) {
+        fail = "a recorded cast is malformed";
+        break;
+      }
+      v = LLVMBuildCast(b, llvm_rec_casts[a[0]], x, ty, "");
+      break;
+    case LLVM_REC_SELECT:
+      if (n != 3 || !(x = llvm_rec_operand(values, num_values, a[0])) ||
+          LLVMTypeOf(x) != LLVMInt1TypeInContext(ctx) ||
+          !(y = llvm_rec_operand(values, num_values, a[1])) ||
+          !(z = llvm_rec_operand(values, num_values, a[2])) ||
+          LLVMTypeOf(y) != LLVMTypeOf(z)) {
+        fail = "a recorded select is malformed";
+        break;
+      }
+      v = LLVMBuildSelect(b, x, y, z, "");
+      break;
+    case LLVM_REC_PHI:
+      if (n != 0 || ty_code == LLVM_REC_VOID) {
+        fail = "a recorded phi is malformed";
+        break;
+      }
+      v = LLVMBuildPhi(b, ty, "");
+      break;
+    case LLVM_REC_INCOMING: {
+      if (n != 3 || !(x = llvm_rec_operand(values, num_values, a[0])) ||
+          !LLVMIsAPHINode(x) ||
+          !(y = llvm_rec_operand(values, num_values, a[1])) ||
+          LLVMTypeOf(x) != LLVMTypeOf(y) || a[2] < 0 || a[2] >= num_blocks) {
+        fail = "a recorded incoming value is malformed";
+        break;
+      }
+      LLVMBasicBlockRef from = blocks[a[2]];
+      LLVMAddIncoming(x, &y, &from, 1);
+      break;
+    }
+    case LLVM_REC_ALLOCA:
+      if (n != 1 || a[0] == LLVM_REC_VOID || !llvm_rec_type_ok(a[0])) {
+        fail = "a recorded alloca is malformed";
+        break;
+      }
+      v = LLVMBuildAlloca(b, llvm_rec_type(ctx, a[0]), "");
+      break;
+    case LLVM_REC_LOAD:
+      if (n != 1 || ty_code == LLVM_REC_VOID ||
+          !(x = llvm_rec_operand(values, num_values, a[0]))) {
+        fail = "a recorded load is malformed";
+        break;
+      }
+      v = LLVMBuildLoad2(b, ty, x, "");
+      break;
+    case LLVM_REC_STORE:
+      if (n != 2 || !(x = llvm_rec_operand(values, num_values, a[0])) ||
+          !(y = llvm_rec_operand(values, num_values, a[1]))) {
+        fail = "a recorded store is malformed";
+        break;
+      }
+      LLVMBuildStore(b, x, y);
+      break;
+    case LLVM_REC_CALL: {
+      // The callee, then the signature, then the arguments.
+      if (n < 3 || a[0] < 0 || a[0] >= num_names ||
+          !llvm_rec_signature_ok(a + 1, n - 1) || n != 3 + 2 * a[2]) {
+        fail = "a recorded call is malformed";
+        break;
+      }
+      int32_t num_args = (int32_t)a[2];
+      LLVMValueRef *args =
+          (LLVMValueRef *)malloc((num_args + 1) * sizeof(LLVMValueRef));
+      for (int32_t i = 0; i < num_args && !fail; i++) {
+        args[i] = llvm_rec_operand(values, num_values, a[3 + num_args + i]);
+        if (!args[i]) {
+          fail = "a recorded call is malformed";
+        }
+      }
+      if (fail) {
+        free(args);
+        break;
+      }
+      LLVMTypeRef fty = llvm_rec_function_type(ctx, a + 1);
+      LLVMValueRef callee =
+          a[0] == 0 ? fn : LLVMGetNamedFunction(m, name[a[0]]);
+      if (!callee) {
+        callee = LLVMAddFunction(m, name[a[0]], fty);
+        added[num_added++] = callee;
+      }
+      v = LLVMBuildCall2(b, fty, callee, args, num_args, "");
+      free(args);
+      break;
+    }
+    case LLVM_REC_BR:
+      if (n != 1 || a[0] < 0 || a[0] >= num_blocks) {
+        fail = "a recorded branch is malformed";
+        break;
+      }
+      LLVMBuildBr(b, blocks[a[0]]);
+      break;
+    case LLVM_REC_COND_BR:
+      if (n != 3 || !(x = llvm_rec_operand(values, num_values, a[0])) ||
+          LLVMTypeOf(x) != LLVMInt1TypeInContext(ctx) || a[1] < 0 || a[1] >= num_blocks || a[2] < 0 || a[2] >= num_blocks) {
+        fail = "a recorded branch is malformed";
+        break;
+      }
+      LLVMBuildCondBr(b, x, blocks[a[1]], blocks[a[2]]);
+      break;
+    case LLVM_REC_RET:
+      if (n != 1 || !(x = llvm_rec_operand(values, num_values, a[0]))) {
+        fail = "a recorded return is malformed";
+        break;
+      }
+      LLVMBuildRet(b, x);
+      break;
+    case LLVM_REC_RET_VOID:
+      LLVMBuildRetVoid(b);
+      break;
+    case LLVM_REC_UNREACHABLE:
+      LLVMBuildUnreachable(b);
+      break;
+    default:
+      fail = "a recorded instruction has an unknown op";
+      break;
+    }
+    if (num_values == capacity) {
+      capacity *= 2;
+      values = (LLVMValueRef *)realloc(values, capacity * sizeof(LLVMValueRef));
+    }
+    values[num_values++] = v;
+  }
+  LLVMDisposeBuilder(b);
+  free(values);
+  free(blocks);
+  char *message = NULL;
+  if (!fail && LLVMVerifyFunction(fn, LLVMReturnStatusAction)) {
+    // Only the module verifier says what is wrong.
+    LLVMVerifyModule(m, LLVMReturnStatusAction, &message);
+    size_t end = message ? strlen(message) : 0;
+    while (end > 0 && message[end - 1] == '\n') {
+      message[--end] = '\0';
+    }
+    fail = end > 0 ? message : "the recorded function is invalid";
+  }
+  if (fail) {
+    llvm_codegen_fail(error, fail);
+    if (message) {
+      LLVMDisposeMessage(message);
+    }
+    LLVMDeleteFunction(fn);
+    for (int32_t i = 0; i < num_added; i++) {
+      LLVMDeleteFunction(added[i]);
+    }
+    free(added);
+    free(name);
+    return NULL;
+  }
+  free(added);
+  if (decl) {
+    LLVMReplaceAllUsesWith(decl, fn);
+    LLVMDeleteFunction(decl);
+  }
+  LLVMSetValueName2(fn, name[0], strlen(name[0]));
+  free(name);
+  return fn;
+}
+
+// Builds the function recorded in `code` into `m`, on the calling thread,
+// as described for `llvm_rec_build`.
+LLVMValueRef __llvm_rec_materialize(LLVMModuleRef m, int64_t *code,
+                                    int32_t len, const char *names,
+                                    int32_t num_names, char **error) {
+  return llvm_rec_build(m, code, len, names, num_names, error);
+}
+
+typedef struct {
+  pthread_t thread;
+  int64_t *code;
+  int32_t len;
+  char *names;
+  int32_t num_names;
+  int opt_level;
+  char *passes;
+  LLVMMemoryBufferRef bitcode;
+  char *error;
+} llvm_rec_job;
+
+static void *llvm_rec_job_run(void *arg) {
+  llvm_rec_job *job = (llvm_rec_job *)arg;
+  LLVMContextRef ctx = LLVMContextCreate();
+  LLVMModuleRef m = LLVMModuleCreateWithNameInContext(job->names, ctx);
+  LLVMTargetMachineRef tm = llvm_create_host_target_machine(
+      job->opt_level, LLVMRelocPIC, LLVMCodeModelDefault);
+  if (!tm) {
+    llvm_codegen_fail(&job->error, "host target is not available");
+  } else {
+    char *triple = LLVMGetTargetMachineTriple(tm);
+    LLVMSetTarget(m, triple);
+    LLVMDisposeMessage(triple);
+    LLVMTargetDataRef dl = LLVMCreateTargetDataLayout(tm);
+    LLVMSetModuleDataLayout(m, dl);
+    LLVMDisposeTargetData(dl);
+  }
+  if (tm && llvm_rec_build(m, job->code, job->len, job->names, job->num_names,
+                           &job->error)) {
+    LLVMErrorRef err = NULL;
+    if (*job->passes) {
+      LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+      err = LLVMRunPasses(m, job->passes, tm, options);
+      LLVMDisposePassBuilderOptions(options);
+    }
+    if (err) {
+      char *message = LLVMGetErrorMessage(err);
+      llvm_codegen_fail(&job->error, message);
+      LLVMDisposeErrorMessage(message);
+    } else {
+      job->bitcode = LLVMWriteBitcodeToMemoryBuffer(m);
+    }
+  }
+  if (tm) {
+    LLVMDisposeTargetMachine(tm);
+  }
+  LLVMDisposeModule(m);
+  LLVMContextDispose(ctx);
+  return NULL;
+}
+
+// Builds the function recorded in `code` into a module of its own, in a
+// context of its own on a background thread, then runs `passes` (none if
+// empty) over it and serializes it. `code` and `names` are copied.
+void *__llvm_rec_job_start(int64_t *code, int32_t len, const char *names,
+                           int32_t num_names, int32_t opt_level,
+                           const char *passes) {
+  llvm_rec_job *job = (llvm_rec_job *)calloc(1, sizeof(llvm_rec_job));
+  job->code = (int64_t *)malloc((len + 1) * sizeof(int64_t));
+  memcpy(job->code, code, len * sizeof(int64_t));
+  job->len = len;
+  size_t size = 0;
+  for (int32_t i = 0; i < num_names; i++) {
+    size += strlen(names + size) + 1;
+  }
+  job->names = (char *)malloc(size + 1);
+  memcpy(job->names, names, size);
+  job->num_names = num_names;
+  job->opt_level = opt_level;
+  job->passes = strdup(passes);
+  if (pthread_create(&job->thread, NULL, llvm_rec_job_run, job) != 0) {
+    // No thread available, build on the caller's thread instead.
+    llvm_rec_job_run(job);
+    job->thread = pthread_self();
+  }
+  return job;
+}
+
+// Waits for the job. The bitcode and the error message are then owned by
+// the caller, the job itself is freed.
+void __llvm_rec_job_join(void *job, void **bitcode, char **error) {
+  llvm_rec_job *j = (llvm_rec_job *)job;
+  if (!pthread_equal(j->thread, pthread_self())) {
+    pthread_join(j->thread, NULL);
+  }
+  *bitcode = j->bitcode;
+  *error = j->error;
+  free(j->code);
+  free(j->names);
+  free(j->passes);
+  free(j);
+}
+
+// Function multiversioning
+
+static void llvm_copy_attributes(LLVMValueRef from, LLVMValueRef to,
+                                 LLVMAttributeIndex idx) {
+  unsigned n = LLVMGetAttributeCountAtIndex(from, idx);
+  if (!n) {
+    return;
+  }
+  LLVMAttributeRef *attrs =
+      (LLVMAttributeRef *)malloc(n * sizeof(LLVMAttributeRef));
+  LLVMGetAttributesAtIndex(from, idx, attrs);
+  for (unsigned i = 0; i < n; i++) {
+    LLVMAddAttributeAtIndex(to, idx, attrs[i]);
+  }
+  free(attrs);
+}
+
+// Adds a function named `name` to the module of `fn`, of the same type and
+// calling convention, and the attributes of its result and parameters, but
+// none of those of the function itself: it is to forward calls of `fn`,
+// which does not make it, say, `speculatable` or `willreturn`.
+LLVMValueRef __llvm_add_forwarder(LLVMValueRef fn, const char *name) {
+  LLVMModuleRef m = LLVMGetGlobalParent(fn);
+  LLVMValueRef nf = LLVMAddFunction(m, name, LLVMGlobalGetValueType(fn));
+  LLVMSetFunctionCallConv(nf, LLVMGetFunctionCallConv(fn));
+  llvm_copy_attributes(fn, nf, LLVMAttributeReturnIndex);
+  for (unsigned i = 0; i < LLVMCountParams(fn); i++) {
+    llvm_copy_attributes(fn, nf, i + 1);
+  }
+  return nf;
+}
+
+// Whether a block of `fn` has its address taken by a `blockaddress`. The
+// constant names the block of `fn` wherever it is, such as in the jump
+// table of a global, so a copy of the body cannot follow it.
+LLVMBool __llvm_has_address_taken_block(LLVMValueRef fn) {
+  for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    for (LLVMUseRef u = LLVMGetFirstUse(LLVMBasicBlockAsValue(bb)); u;
+         u = LLVMGetNextUse(u)) {
+      if (LLVMIsABlockAddress(LLVMGetUser(u))) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Adds a function named `name` to the module of `fn`, of the same type,
+// calling convention and attributes, and a copy of its body. Calls of `fn`
+// in the body become calls of the copy. The debug info is not copied, and
+// `fn` must not take the address of its blocks.
+LLVMValueRef __llvm_clone_function(LLVMValueRef fn, const char *name) {
+  LLVMModuleRef m = LLVMGetGlobalParent(fn);
+  LLVMContextRef ctx = LLVMGetModuleContext(m);
+  LLVMValueRef nf = __llvm_add_forwarder(fn, name);
+  llvm_copy_attributes(fn, nf, LLVMAttributeFunctionIndex);
+  unsigned num_params = LLVMCountParams(fn);
+  if (LLVMIsDeclaration(fn)) {
+    return nf;
+  }
+  if (LLVMHasPersonalityFn(fn)) {
+    LLVMSetPersonalityFn(nf, LLVMGetPersonalityFn(fn));
+  }
+  if (LLVMGetGC(fn)) {
+    LLVMSetGC(nf, LLVMGetGC(fn));
+  }
+  if (LLVMGetSection(fn)) {
+    LLVMSetSection(nf, LLVMGetSection(fn));
+  }
+  llvm_ptr_map map = {0};
+  llvm_ptr_map_put(&map, fn, nf);
+  for (unsigned i = 0; i < num_params; i++) {
+    LLVMValueRef param = LLVMGetParam(fn, i);
+    size_t len;
+    const char *param_name = LLVMGetValueName2(param, &len);
+    LLVMValueRef copy = LLVMGetParam(nf, i);
+    LLVMSetValueName2(copy, param_name, len);
+    llvm_ptr_map_put(&map, param, copy);
+  }
+  for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    LLVMBasicBlockRef copy =
+        LLVMAppendBasicBlockInContext(ctx, nf, LLVMGetBasicBlockName(bb));
+    llvm_ptr_map_put(&map, LLVMBasicBlockAsValue(bb),
+                     LLVMBasicBlockAsValue(copy));
+  }
+
+  // Copy the instructions, then point their operands at the copies. The
+  // C API cannot change the blocks of a phi, so phis are built anew.
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+  for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    LLVMBasicBlockRef block = LLVMValueAsBasicBlock(
+        llvm_ptr_map_get(&map, LLVMBasicBlockAsValue(bb)));
+    LLVMPositionBuilderAtEnd(b, block);
+    for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+         inst = LLVMGetNextInstruction(inst)) {
+      if (LLVMIsADbgInfoIntrinsic(inst)) {
+        continue;
+      }
+      const char *inst_name = LLVMGetValueName(inst);
+      LLVMValueRef copy;
+      if (LLVMIsAPHINode(inst)) {
+        copy = LLVMBuildPhi(b, LLVMTypeOf(inst), inst_name);
+      } else {
+        copy = LLVMInstructionClone(inst);
+        LLVMInsertIntoBuilderWithName(b, copy, inst_name);
+      }
+      LLVMInstructionSetDebugLoc(copy, NULL);
+      llvm_ptr_map_put(&map, inst, copy);
+    }
+  }
+  for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+         inst = LLVMGetNextInstruction(inst)) {
+      LLVMValueRef copy = (LLVMValueRef)llvm_ptr_map_get(&map, inst);
+      if (!copy) {
+        continue;
+      }
+      if (LLVMIsAPHINode(inst)) {
+        unsigned n = LLVMCountIncoming(inst);
+        for (unsigned i = 0; i < n; i++) {
+          LLVMValueRef v = LLVMGetIncomingValue(inst, i);
+          LLVMValueRef mapped = (LLVMValueRef)llvm_ptr_map_get(&map, v);
+          LLVMBasicBlockRef from = LLVMValueAsBasicBlock(llvm_ptr_map_get(
+              &map, LLVMBasicBlockAsValue(LLVMGetIncomingBlock(inst, i))));
+          LLVMValueRef incoming = mapped ? mapped : v;
+          LLVMAddIncoming(copy, &incoming, &from, 1);
+        }
+        continue;
+      }
+      int n = LLVMGetNumOperands(copy);
+      for (int i = 0; i < n; i++) {
+        LLVMValueRef mapped =
+            (LLVMValueRef)llvm_ptr_map_get(&map, LLVMGetOperand(copy, i));
+        if (mapped) {
+          LLVMSetOperand(copy, i, mapped);
+        }
+      }
+    }
+  }
+  LLVMDisposeBuilder(b);
+  free(map.keys);
+  free(map.values);
+  return nf;
+}
+
+// Builds, at the end of `b`, a tail call of `callee` with the parameters of
+// the function being built, `fn`, and the return of its result.
+LLVMValueRef __llvm_build_forwarding_call(LLVMBuilderRef b, LLVMValueRef fn,
+                                          LLVMValueRef callee) {
+  LLVMTypeRef fty = LLVMGlobalGetValueType(fn);
+  unsigned n = LLVMCountParams(fn);
+  LLVMValueRef *args = (LLVMValueRef *)malloc((n + 1) * sizeof(LLVMValueRef));
+  LLVMGetParams(fn, args);
+  LLVMValueRef call = LLVMBuildCall2(b, fty, callee, args, n, "");
+  free(args);
+  LLVMSetInstructionCallConv(call, LLVMGetFunctionCallConv(fn));
+  LLVMSetTailCall(call, 1);
+  // The call site needs the ABI attributes of the parameters, such as
+  // `byval` and `sret`, for the callee to find them where it expects.
+  for (unsigned idx = 0; idx <= n; idx++) {
+    unsigned count = LLVMGetAttributeCountAtIndex(fn, idx);
+    if (!count) {
+      continue;
+    }
+    LLVMAttributeRef *attrs =
+        (LLVMAttributeRef *)malloc(count * sizeof(LLVMAttributeRef));
+    LLVMGetAttributesAtIndex(fn, idx, attrs);
+    for (unsigned i = 0; i < count; i++) {
+      LLVMAddCallSiteAttribute(call, idx, attrs[i]);
+    }
+    free(attrs);
+  }
+  if (LLVMGetTypeKind(LLVMGetReturnType(fty)) == LLVMVoidTypeKind) {
+    return LLVMBuildRetVoid(b);
+  }
+  return LLVMBuildRet(b, call);
+}
+
+// Returns the x86-64 microarchitecture level of the CPU running it, from 1
+// to 4, as told by `cpuid`, and by `xgetbv` for the state the OS saves.
+static const char llvm_x86_level_probe[] =
+    "define linkonce_odr hidden i32 @__mv_x86_64_level() nounwind {\n"
+    "entry:\n"
+    "  %r0 = call { i32, i32, i32, i32 } asm \"cpuid\", "
+    "\"={ax},={bx},={cx},={dx},{ax},{cx}\"(i32 0, i32 0)\n"
+    "  %max = extractvalue { i32, i32, i32, i32 } %r0, 0\n"
+    "  %r1 = call { i32, i32, i32, i32 } asm \"cpuid\", "
+    "\"={ax},={bx},={cx},={dx},{ax},{cx}\"(i32 1, i32 0)\n"
+    "  %ecx1 = extractvalue { i32, i32, i32, i32 } %r1, 2\n"
+    "  %has7 = icmp uge i32 %max, 7\n"
+    "  br i1 %has7, label %leaf7, label %ext\n"
+    "leaf7:\n"
+    "  %r7 = call { i32, i32, i32, i32 } asm \"cpuid\", "
+    "\"={ax},={bx},={cx},={dx},{ax},{cx}\"(i32 7, i32 0)\n"
+    "  %ebx7.0 = extractvalue { i32, i32, i32, i32 } %r7, 1\n"
+    "  br label %ext\n"
+    "ext:\n"
+    "  %ebx7 = phi i32 [ 0, %entry ], [ %ebx7.0, %leaf7 ]\n"
+    "  %e0 = call { i32, i32, i32, i32 } asm \"cpuid\", "
+    "\"={ax},={bx},={cx},={dx},{ax},{cx}\"(i32 -2147483648, i32 0)\n"
+    "  %maxext = extractvalue { i32, i32, i32, i32 } %e0, 0\n"
+    "  %hasext = icmp uge i32 %maxext, -2147483647\n"
+    "  br i1 %hasext, label %leafext, label %xsave\n"
+    "leafext:\n"
+    "  %e1 = call { i32, i32, i32, i32 } asm \"cpuid\", "
+    "\"={ax},={bx},={cx},={dx},{ax},{cx}\"(i32 -2147483647, i32 0)\n"
+    "  %ecxext.0 = extractvalue { i32, i32, i32, i32 } %e1, 2\n"
+    "  br label %xsave\n"
+    "xsave:\n"
+    "  %ecxext = phi i32 [ 0, %ext ], [ %ecxext.0, %leafext ]\n"
+    "  %osxsave = and i32 %ecx1, 134217728\n"
+    "  %hasxgetbv = icmp ne i32 %osxsave, 0\n"
+    "  br i1 %hasxgetbv, label %xgetbv, label %level\n"
+    "xgetbv:\n"
+    "  %x = call { i32, i32 } asm \"xgetbv\", \"={ax},={dx},{cx}\"(i32 0)\n"
+    "  %xcr0.0 = extractvalue { i32, i32 } %x, 0\n"
+    "  br label %level\n"
+    "level:\n"
+    "  %xcr0 = phi i32 [ 0, %xsave ], [ %xcr0.0, %xgetbv ]\n"
+    // v2: SSE3, SSSE3, CMPXCHG16B, SSE4.1, SSE4.2, POPCNT and LAHF.
+    "  %a = and i32 %ecx1, 9970177\n"
+    "  %a.ok = icmp eq i32 %a, 9970177\n"
+    "  %b = and i32 %ecxext, 1\n"
+    "  %b.ok = icmp ne i32 %b, 0\n"
+    "  %v2 = and i1 %a.ok, %b.ok\n"
+    // v3: FMA, MOVBE, XSAVE, AVX, F16C, BMI1, AVX2, BMI2, LZCNT, and the
+    // YMM state saved.
+    "  %c = and i32 %ecx1, 943722496\n"
+    "  %c.ok = icmp eq i32 %c, 943722496\n"
+    "  %d = and i32 %ebx7, 296\n"
+    "  %d.ok = icmp eq i32 %d, 296\n"
+    "  %e = and i32 %ecxext, 32\n"
+    "  %e.ok = icmp ne i32 %e, 0\n"
+    "  %f = and i32 %xcr0, 6\n"
+    "  %f.ok = icmp eq i32 %f, 6\n"
+    "  %v3.0 = and i1 %c.ok, %d.ok\n"
+    "  %v3.1 = and i1 %e.ok, %f.ok\n"
+    "  %v3.2 = and i1 %v3.0, %v3.1\n"
+    "  %v3 = and i1 %v2, %v3.2\n"
+    // v4: AVX-512 F, DQ, CD, BW and VL, and the ZMM state saved.
+    "  %g = and i32 %ebx7, -805109760\n"
+    "  %g.ok = icmp eq i32 %g, -805109760\n"
+    "  %h = and i32 %xcr0, 230\n"
+    "  %h.ok = icmp eq i32 %h, 230\n"
+    "  %v4.0 = and i1 %g.ok, %h.ok\n"
+    "  %v4 = and i1 %v3, %v4.0\n"
+    "  %l2 = zext i1 %v2 to i32\n"
+    "  %l3 = zext i1 %v3 to i32\n"
+    "  %l4 = zext i1 %v4 to i32\n"
+    "  %l = add i32 %l2, %l3\n"
+    "  %l.1 = add i32 %l, %l4\n"
+    "  %result = add i32 %l.1, 1\n"
+    "  ret i32 %result\n"
+    "}\n";
+
+// Returns `__mv_x86_64_level()`, which tells the x86-64 level of the CPU,
+// defining it in `m` if it is not, or NULL with `*error` set.
+LLVMValueRef __llvm_add_x86_level_probe(LLVMModuleRef m, char **error) {
+  LLVMValueRef probe = LLVMGetNamedFunction(m, "__mv_x86_64_level");
+  if (probe && !LLVMIsDeclaration(probe)) {
+    return probe;
+  }
+  // The linker only brings in the linkonce definition for a declaration.
+  LLVMContextRef ctx = LLVMGetModuleContext(m);
+  if (!probe) {
+    LLVMAddFunction(m, "__mv_x86_64_level",
+                    LLVMFunctionType(LLVMInt32TypeInContext(ctx), NULL, 0, 0));
+  }
+  LLVMMemoryBufferRef buf = LLVMCreateMemoryBufferWithMemoryRangeCopy(
+      llvm_x86_level_probe, strlen(llvm_x86_level_probe), "x86_level");
+  LLVMModuleRef src = NULL;
+  char *message = NULL;
+  // The parser takes the buffer and frees it.
+  if (LLVMParseIRInContext(ctx, buf, &src, &message)) {
+    llvm_codegen_fail(error, message);
+    LLVMDisposeMessage(message);
+    return NULL;
+  }
+  LLVMSetTarget(src, LLVMGetTarget(m));
+  LLVMSetDataLayout(src, LLVMGetDataLayoutStr(m));
+  if (LLVMLinkModules2(m, src)) {
+    llvm_codegen_fail(error, "cannot link the x86 level probe");
+    return NULL;
+  }
+  return LLVMGetNamedFunction(m, "__mv_x86_64_level");
+}